@@ -3,9 +3,11 @@
 #include "Algorithms/AlgorithmTester.h"
 #include "Algorithms/Presets/Preset_WFC_Gen.h"
 #include "Algorithms/WFC_Interface.h"
+#include "Algorithms/OverlappingWFC3D.h"
 #include "Algorithms/RegionGrammar.h"
 #include "Util/DebugPrinting.h"
 #include "Math/UnrealMathUtility.h"
+#include "HAL/PlatformTime.h"
 
 void UAlgorithmTester::SimpleImageWFC(int32 SizeX, int32 SizeY, UDataTable* SeedData) {
     WFC_Interface<PRESET_MediumHalls> wfc;
@@ -45,12 +47,7 @@ FWFCOutput UAlgorithmTester::TestGrammarToWFC(FMyEventDelegate delegate, int32 R
     for (const auto& [region, pair] : WFC_SPECIFICATIONS) {
         std::visit([&](auto&& s) {
             auto& non_const_s = const_cast<std::remove_const_t<std::remove_reference_t<decltype(s)>>&>(s);
-            auto& path_prop = SEED_PATHS[pair.properties.seed_table_id];
-
-            path_prop.load();
-            non_const_s.seed = non_const_s.generator.ReadImage_CSV(path_prop.table);
-            check(non_const_s.seed.width > 0);
-            check(non_const_s.seed.height > 0);
+            non_const_s.Load(pair.properties.seed_table_id);
         }, pair.spec);
     }
 
@@ -78,7 +75,7 @@ FWFCOutput UAlgorithmTester::TestGrammarToWFC(FMyEventDelegate delegate, int32 R
         // Fill with WFC specified by region label. 
         std::visit([&](auto&& s) {
             location_t modified_grid = GRID_SIZE / s.scale;
-            auto [generated, property_matrix] = s.generator.Generate_WFC_Region(s.seed, modified_grid, exit, node->region_label);
+            auto [generated, property_matrix] = s.Generate(modified_grid, exit, node->region_label);
 
             location_t offset = node->location * GRID_SIZE;
 
@@ -144,4 +141,213 @@ FWFCOutput UAlgorithmTester::TestGrammarToWFC(FMyEventDelegate delegate, int32 R
     output.ExtentY_max = max_bounds.y;
     return output;
     
-}
\ No newline at end of file
+}
+
+void UAlgorithmTester::CompileSeedRules() {
+    WFC_Interface<PRESET_MediumHalls> wfc;
+    for (auto& [seed_id, path_prop] : SEED_PATHS) {
+        path_prop.load();
+        auto seed = wfc.ReadImage_CSV(path_prop.table);
+        FString rules_path = path_prop.rules_path();
+        bool saved = wfc.CompileRules(seed, rules_path);
+
+        FString result = FString::Printf(TEXT("%s %s"), saved ? TEXT("Compiled") : TEXT("Failed to write"), *rules_path);
+        UE_LOG(LogTemp, Display, TEXT("%s"), *result);
+        GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, result);
+    }
+}
+
+void UAlgorithmTester::BenchmarkPropagators(int32 RegionSize, int32 Runs) {
+    WFC_Interface<PRESET_MediumHalls> wfc;
+    const std::pair<PropagatorEngine, const TCHAR*> engines[] = {
+        { PropagatorEngine::ac4, TEXT("AC-4") },
+        { PropagatorEngine::bitset, TEXT("bitset") },
+    };
+
+    for (char seed_id : { 'h', 'v' }) {
+        auto& path_prop = SEED_PATHS[seed_id];
+        path_prop.load();
+        auto seed = wfc.ReadImage_CSV(path_prop.table);
+        auto options = wfc.MakeOptions(location_t{ RegionSize, RegionSize });
+
+        for (const auto& [engine, name] : engines) {
+            options.solver.propagator_engine = engine;
+            int32 solved = 0;
+            double start = FPlatformTime::Seconds();
+            for (int32 run = 0; run < Runs; run++) {
+                WFC_Interface<PRESET_MediumHalls>::WFC_Model solver(seed, options, run + 1);
+                if (solver.run().has_value()) solved++;
+            }
+            double elapsed_ms = (FPlatformTime::Seconds() - start) * 1000.0;
+
+            FString result = FString::Printf(TEXT("%s %s: %d/%d solved, %.2f ms per run"),
+                UTF8_TO_TCHAR(path_prop.path.c_str()), name, solved, Runs, Runs > 0 ? elapsed_ms / Runs : 0.0);
+            UE_LOG(LogTemp, Display, TEXT("%s"), *result);
+            GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, result);
+        }
+    }
+}
+
+void UAlgorithmTester::BenchmarkObservations(int32 RegionSize, int32 Runs) {
+    WFC_Interface<PRESET_MediumHalls> wfc;
+    const std::pair<ObservationStrategy, const TCHAR*> strategies[] = {
+        { ObservationStrategy::min_entropy, TEXT("min entropy") },
+        { ObservationStrategy::scanline, TEXT("scanline") },
+        { ObservationStrategy::frontier, TEXT("frontier") },
+    };
+
+    for (char seed_id : { 'h', 'v' }) {
+        auto& path_prop = SEED_PATHS[seed_id];
+        path_prop.load();
+        auto seed = wfc.ReadImage_CSV(path_prop.table);
+        auto options = wfc.MakeOptions(location_t{ RegionSize, RegionSize });
+
+        for (const auto& [strategy, name] : strategies) {
+            options.solver.observation = strategy;
+            int32 solved = 0;
+            WFCStats total;
+            double start = FPlatformTime::Seconds();
+            for (int32 run = 0; run < Runs; run++) {
+                WFC_Interface<PRESET_MediumHalls>::WFC_Model solver(seed, options, run + 1);
+                if (solver.run().has_value()) solved++;
+                total.nb_observations += solver.get_stats().nb_observations;
+                total.nb_contradictions += solver.get_stats().nb_contradictions;
+                total.nb_backtracks += solver.get_stats().nb_backtracks;
+            }
+            double elapsed_ms = (FPlatformTime::Seconds() - start) * 1000.0;
+
+            FString result = FString::Printf(TEXT("%s %s: %d/%d solved, %.2f ms per run, %u observations, %u contradictions, %u backtracks"),
+                UTF8_TO_TCHAR(path_prop.path.c_str()), name, solved, Runs, Runs > 0 ? elapsed_ms / Runs : 0.0,
+                total.nb_observations, total.nb_contradictions, total.nb_backtracks);
+            UE_LOG(LogTemp, Display, TEXT("%s"), *result);
+            GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, result);
+        }
+    }
+}
+
+void UAlgorithmTester::BenchmarkTiledModel(int32 RegionSize, int32 Runs) {
+    using Interface = WFC_Interface<PRESET_MediumHalls>;
+    Interface wfc;
+
+    auto& seed_prop = SEED_PATHS['h'];
+    seed_prop.load();
+    auto seed = wfc.ReadImage_CSV(seed_prop.table);
+    auto options = wfc.MakeOptions(location_t{ RegionSize, RegionSize });
+
+    auto tileset = TILESET_PATHS['h'].read(wfc);
+    if (!tileset) {
+        UE_LOG(LogTemp, Warning, TEXT("No tiles_halls tileset, skipping the tiled model benchmark."));
+        return;
+    }
+    const int32 tile_size = static_cast<int32>(tileset->tile_size);
+    const int32 tiled_size = (RegionSize + tile_size - 1) / tile_size * tile_size;
+    auto tiled_options = wfc.MakeTiledOptions(location_t{ tiled_size, tiled_size });
+
+    auto benchmark = [&](const TCHAR* name, auto make_solver) {
+        int32 solved = 0;
+        WFCStats total;
+        double start = FPlatformTime::Seconds();
+        for (int32 run = 0; run < Runs; run++) {
+            auto solver = make_solver(run + 1);
+            if (solver.run().has_value()) solved++;
+            total.nb_observations += solver.get_stats().nb_observations;
+            total.nb_contradictions += solver.get_stats().nb_contradictions;
+            total.nb_backtracks += solver.get_stats().nb_backtracks;
+        }
+        double elapsed_ms = (FPlatformTime::Seconds() - start) * 1000.0;
+
+        FString result = FString::Printf(TEXT("%s: %d/%d solved, %.2f ms per run, %u observations, %u contradictions, %u backtracks"),
+            name, solved, Runs, Runs > 0 ? elapsed_ms / Runs : 0.0,
+            total.nb_observations, total.nb_contradictions, total.nb_backtracks);
+        UE_LOG(LogTemp, Display, TEXT("%s"), *result);
+        GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, result);
+    };
+
+    benchmark(TEXT("Overlapping seed_h"), [&](int32 run_seed) { return Interface::WFC_Model(seed, options, run_seed); });
+    benchmark(TEXT("Tiled tiles_halls"), [&](int32 run_seed) { return Interface::WFC_Tiled_Model(tileset, tiled_options, run_seed); });
+
+    // Whole regions, with their border and an exit on every side. The border takes tile_size - 1 pixels on each side, and
+    // the region with its border has to be a whole number of tiles. 
+    const int32 border = 2 * (tile_size - 1);
+    const int32 region_size = (RegionSize + border + tile_size - 1) / tile_size * tile_size - border;
+    double start = FPlatformTime::Seconds();
+    int32 generated = 0;
+    for (int32 run = 0; run < Runs; run++)
+        if (wfc.Generate_Tiled_Region(tileset, location_t{ region_size, region_size }, { E_TOP, E_BOTTOM, E_LEFT, E_RIGHT }).raw_labels.width > 0)
+            generated++;
+    double elapsed_ms = (FPlatformTime::Seconds() - start) * 1000.0;
+
+    const auto& stats = wfc.GetGenerationStats();
+    FString result = FString::Printf(TEXT("Tiled tiles_halls regions of %d: %d/%d generated, %.2f ms per region, %d attempts, %d successes, %d constrained, %d invalid exit paths, %d aborted, %d cancelled"),
+        region_size, generated, Runs, Runs > 0 ? elapsed_ms / Runs : 0.0, stats.attempts, stats.successes,
+        stats.constrained, stats.invalid_exit_paths, stats.aborted, stats.cancelled);
+    UE_LOG(LogTemp, Display, TEXT("%s"), *result);
+    GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, result);
+}
+
+void UAlgorithmTester::BenchmarkRegionAttempts(int32 RegionSize, int32 Runs) {
+    for (char seed_id : { 'h', 'v' }) {
+        WFC_Interface<PRESET_MediumHalls> wfc;
+        auto& path_prop = SEED_PATHS[seed_id];
+        path_prop.load();
+        auto seed = wfc.ReadImage_CSV(path_prop.table);
+
+        double start = FPlatformTime::Seconds();
+        for (int32 run = 0; run < Runs; run++)
+            wfc.Generate_WFC_Region(seed, location_t{ RegionSize, RegionSize }, { E_TOP, E_LEFT, E_RIGHT });
+        double elapsed_ms = (FPlatformTime::Seconds() - start) * 1000.0;
+
+        const auto& stats = wfc.GetGenerationStats();
+        FString result = FString::Printf(TEXT("%s: %.2f ms per region, %d attempts, %d successes, %d constrained, %d invalid exit paths, %d aborted, %d cancelled"),
+            UTF8_TO_TCHAR(path_prop.path.c_str()), Runs > 0 ? elapsed_ms / Runs : 0.0, stats.attempts, stats.successes,
+            stats.constrained, stats.invalid_exit_paths, stats.aborted, stats.cancelled);
+        UE_LOG(LogTemp, Display, TEXT("%s"), *result);
+        GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, result);
+    }
+}
+
+void UAlgorithmTester::BenchmarkVolumeModel(int32 RegionSize, int32 Decks, int32 Runs) {
+    WFC_Interface<PRESET_MediumHalls> wfc;
+    auto& seed_prop = SEED_PATHS['h'];
+    seed_prop.load();
+    auto seed = wfc.ReadImage_CSV(seed_prop.table);
+
+    // Two decks of halls, with a floor between them holding a shaft at some of the hall crossings. 
+    Array3D<TCHAR> input(3, seed.height, seed.width);
+    for (std::size_t y = 0; y < seed.height; y++) for (std::size_t x = 0; x < seed.width; x++) {
+        input.get(0, y, x) = seed.get(y, x);
+        input.get(1, y, x) = seed.get(y, x) == 'c' && x % 5 == 1 && y % 5 == 1 ? 'S' : '#';
+        input.get(2, y, x) = seed.get(y, x);
+    }
+
+    // Patterns of 3x3 voxels on two decks, so the shafts are matched across the floor. 
+    OverlappingWFC3DOptions options{ false, false, static_cast<unsigned>(Decks), static_cast<unsigned>(RegionSize),
+        static_cast<unsigned>(RegionSize), 8, 3, 2, {} };
+    options.solver.backtrack_budget = 32;
+
+    double start = FPlatformTime::Seconds();
+    auto rules = OverlappingWFC3D<TCHAR>::make_rules(input, options);
+    double rules_ms = (FPlatformTime::Seconds() - start) * 1000.0;
+
+    int32 solved = 0, shafts = 0;
+    WFCStats total;
+    start = FPlatformTime::Seconds();
+    for (int32 run = 0; run < Runs; run++) {
+        OverlappingWFC3D<TCHAR> solver(options, run + 1, rules);
+        auto volume = solver.run();
+        if (volume.has_value()) {
+            solved++;
+            shafts += static_cast<int32>(std::count(volume->data.begin(), volume->data.end(), TCHAR('S')));
+        }
+        total.nb_observations += solver.get_stats().nb_observations;
+        total.nb_contradictions += solver.get_stats().nb_contradictions;
+        total.nb_backtracks += solver.get_stats().nb_backtracks;
+    }
+    double elapsed_ms = (FPlatformTime::Seconds() - start) * 1000.0;
+
+    FString result = FString::Printf(TEXT("Volume seed_h, %d decks: %d patterns in %.2f ms, %d/%d solved, %.2f ms per run, %d shaft voxels, %u observations, %u contradictions, %u backtracks"),
+        Decks, static_cast<int32>(rules->patterns.size()), rules_ms, solved, Runs, Runs > 0 ? elapsed_ms / Runs : 0.0,
+        shafts, total.nb_observations, total.nb_contradictions, total.nb_backtracks);
+    UE_LOG(LogTemp, Display, TEXT("%s"), *result);
+    GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, result);
+}
@@ -0,0 +1,363 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "Algorithms/array2D.h"
+#include "Algorithms/OverlappingWFC.h"
+
+/**
+ * Options of the chunked WFC, in wave cells.
+ */
+struct ChunkedWFCOptions {
+    unsigned chunk_size = 48;       // The width and height of a chunk.
+    unsigned overlap = 4;           // The number of cells shared by neighbouring chunks.
+    unsigned attempts_per_chunk = 4; // The number of times a chunk is solved before giving up.
+};
+
+/**
+ * Class generating a new image with the overlapping WFC algorithm, one chunk of
+ * the wave at a time, so that the memory used by the solver and the
+ * probability of a contradiction only depend on the size of a chunk.
+ *
+ * Chunks are solved in raster order, and overlap the chunks above and to the
+ * left of them. In a chunk, the cells already solved on its edge are fixed, so
+ * it agrees with its neighbours, while the solved cells inside it are solved
+ * again, so it isn't constrained more than needed. When a chunk fails, it is
+ * solved again with a new seed, extended over its solved neighbours by
+ * options.overlap more cells each time, without restarting the whole region.
+ * Only non periodic outputs are supported.
+ */
+template <typename T, unsigned N = 0> class ChunkedWFC {
+public:
+    using Model = OverlappingWFC<T, N>;
+    using Rules = typename Model::Rules;
+
+private:
+    /**
+     * The input image, and the options of the whole output.
+     */
+    Array2D<T> input;
+    OverlappingWFCOptions options;
+    ChunkedWFCOptions chunk_options;
+
+    /**
+     * The rules shared by every chunk.
+     */
+    std::shared_ptr<const Rules> rules;
+
+    /**
+     * The generator of the seeds of the chunks.
+     */
+    std::minstd_rand gen;
+
+    /**
+     * The constraints set on the whole wave, applied to every chunk they touch.
+     */
+    WFCConstraints fixed;
+
+    /**
+     * The pattern chosen for every cell of the wave, or -1 if the cell isn't
+     * solved yet.
+     */
+    Array2D<int> solved;
+
+    /**
+     * The connectivity constraint, checked once every chunk is solved: the
+     * walkable patterns, packed as in Wave, and the cells to connect.
+     * fixed_walkable is 1 for the cells whose fixed constraints allow a
+     * walkable pattern, computed when the run starts.
+     */
+    std::vector<uint64_t> walkable;
+    std::vector<std::pair<unsigned, unsigned>> required;
+    Array2D<uint8_t> fixed_walkable;
+
+    /**
+     * The counters of the chunks solved by the last run.
+     */
+    WFCStats stats;
+
+    /**
+     * Return true if cell (y, x) is solved with a walkable pattern, or isn't
+     * solved yet and can still have one.
+     */
+    bool can_walk(unsigned y, unsigned x) const noexcept {
+        int pattern = solved.get(y, x);
+        if (pattern < 0) {
+            return fixed_walkable.get(y, x) != 0;
+        }
+        return (walkable[pattern >> 6] >> (pattern & 63)) & 1;
+    }
+
+    /**
+     * Return true if a required cell can't be walkable anymore, or if the
+     * cells that can still be walkable don't connect the required cells.
+     */
+    bool is_doomed() const noexcept {
+        for (auto [y, x] : required) {
+            if (!can_walk(y, x)) {
+                return true;
+            }
+        }
+
+        Array2D<uint8_t> reached(solved.height, solved.width, 0);
+        std::vector<std::pair<unsigned, unsigned>> queue = { required[0] };
+        reached.get(required[0].first, required[0].second) = 1;
+        for (std::size_t next = 0; next < queue.size(); next++) {
+            auto [y, x] = queue[next];
+            for (unsigned direction = 0; direction < 4; direction++) {
+                int ny = static_cast<int>(y) + directions_y[direction];
+                int nx = static_cast<int>(x) + directions_x[direction];
+                if (ny < 0 || nx < 0 || ny >= static_cast<int>(solved.height) ||
+                    nx >= static_cast<int>(solved.width) ||
+                    reached.get(ny, nx) || !can_walk(ny, nx)) {
+                    continue;
+                }
+                reached.get(ny, nx) = 1;
+                queue.push_back({ static_cast<unsigned>(ny), static_cast<unsigned>(nx) });
+            }
+        }
+        for (auto [y, x] : required) {
+            if (!reached.get(y, x)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Return the first cell of every chunk along an axis of size cells.
+     */
+    std::vector<unsigned> get_chunk_starts(unsigned size) const noexcept {
+        const unsigned chunk_size = std::max(chunk_options.chunk_size, 2u);
+        const unsigned step = chunk_size - std::min(chunk_options.overlap, chunk_size - 1);
+        std::vector<unsigned> starts = { 0 };
+        while (starts.back() + chunk_size < size) {
+            starts.push_back(std::min(starts.back() + step, size - chunk_size));
+        }
+        return starts;
+    }
+
+    /**
+     * Solve the cells [y0, y1) x [x0, x1) of the wave. Return false if the
+     * chunk is in contradiction, in which case nothing is changed.
+     */
+    bool solve_chunk(unsigned y0, unsigned x0, unsigned y1, unsigned x1) noexcept {
+        OverlappingWFCOptions chunk = options;
+        chunk.out_height = y1 - y0 + options.pattern_size - 1;
+        chunk.out_width = x1 - x0 + options.pattern_size - 1;
+        chunk.ground = false;
+        Model model(input, chunk, static_cast<int>(gen()), rules);
+
+        WFCConstraints constraints = model.make_constraints();
+        for (unsigned y = y0; y < y1; y++) {
+            for (unsigned x = x0; x < x1; x++) {
+                bool edge = y == y0 || x == x0 || y == y1 - 1 || x == x1 - 1;
+                if (edge && solved.get(y, x) >= 0) {
+                    constraints.add(y - y0, x - x0, static_cast<unsigned>(solved.get(y, x)));
+                }
+            }
+        }
+        for (std::size_t n = 0; n < fixed.size(); n++) {
+            auto [y, x] = fixed.cells[n];
+            if (y >= y0 && y < y1 && x >= x0 && x < x1) {
+                std::copy_n(fixed.get_mask(n), fixed.nb_words,
+                    constraints.add_cell(y - y0, x - x0));
+            }
+        }
+        if (!model.apply_constraints(constraints)) {
+            return false;
+        }
+
+        std::optional<Array2D<unsigned>> result = model.run_pattern_ids();
+        const WFCStats& chunk_stats = model.get_stats();
+        stats.nb_observations += chunk_stats.nb_observations;
+        stats.nb_contradictions += chunk_stats.nb_contradictions;
+        stats.nb_backtracks += chunk_stats.nb_backtracks;
+        stats.nb_repairs += chunk_stats.nb_repairs;
+        if (!result.has_value()) {
+            return false;
+        }
+        for (unsigned y = y0; y < y1; y++) {
+            for (unsigned x = x0; x < x1; x++) {
+                solved.get(y, x) = static_cast<int>(result->get(y - y0, x - x0));
+            }
+        }
+        return true;
+    }
+
+public:
+    /**
+     * Constructor using rules already extracted from input with options.
+     */
+    ChunkedWFC(const Array2D<T>& input, const OverlappingWFCOptions& options,
+        int seed, std::shared_ptr<const Rules> rules,
+        const ChunkedWFCOptions& chunk_options = {}) noexcept
+        : input(input), options(options), chunk_options(chunk_options),
+        rules(std::move(rules)), gen(seed), fixed(this->rules->patterns.size()),
+        solved(options.get_wave_height(), options.get_wave_width(), -1),
+        fixed_walkable(options.get_wave_height(), options.get_wave_width(), 1) {
+        check(!options.periodic_output);
+        check(N == 0 || options.pattern_size == N);
+    }
+
+    /**
+     * The constructor used by the user. The rules of input are taken from the
+     * cache.
+     */
+    ChunkedWFC(const Array2D<T>& input, const OverlappingWFCOptions& options,
+        int seed, const ChunkedWFCOptions& chunk_options = {}) noexcept
+        : ChunkedWFC(input, options, seed, Model::get_rules(input, options),
+            chunk_options) {}
+
+    /**
+     * Set the pattern at a specific position.
+     * Returns false if the given pattern does not exist, or if the
+     * coordinates are not in the wave
+     */
+    bool set_pattern(const Array2D<T>& pattern, unsigned i, unsigned j) noexcept {
+        std::optional<unsigned> pattern_id = get_pattern_id(pattern);
+        return pattern_id.has_value() && add_constraint(fixed, *pattern_id, i, j);
+    }
+
+    /**
+     * Return the id of pattern, from the index of the rules.
+     */
+    std::optional<unsigned> get_pattern_id(const Array2D<T>& pattern) const noexcept {
+        if (pattern.height != options.pattern_size || pattern.width != options.pattern_size) {
+            return std::nullopt;
+        }
+        return rules->find_pattern(pattern);
+    }
+
+    /**
+     * Return an empty batch of constraints for the whole wave.
+     */
+    WFCConstraints make_constraints() const noexcept {
+        return WFCConstraints(rules->patterns.size());
+    }
+
+    /**
+     * Add to constraints the pattern pattern_id at cell (i, j) of the wave.
+     * Returns false if the cell isn't in the wave.
+     */
+    bool add_constraint(WFCConstraints& constraints, unsigned pattern_id,
+        unsigned i, unsigned j) const noexcept {
+        if (i >= options.get_wave_height() || j >= options.get_wave_width()) {
+            return false;
+        }
+        constraints.add(i, j, pattern_id);
+        return true;
+    }
+
+    /**
+     * Keep constraints for the chunks they touch. They are only propagated
+     * when a chunk is solved, so this always returns true and a contradiction
+     * is only found by run.
+     */
+    bool apply_constraints(const WFCConstraints& constraints) noexcept {
+        for (std::size_t n = 0; n < constraints.size(); n++) {
+            auto [i, j] = constraints.cells[n];
+            std::copy_n(constraints.get_mask(n), constraints.nb_words, fixed.add_cell(i, j));
+        }
+        return true;
+    }
+
+    /**
+     * Check that the cells (i, j) of the wave can still be connected every
+     * time a chunk is solved, through the cells whose pattern has a centre
+     * pixel p with walkable(p), and abort the run when they can't. A chunk
+     * doesn't see every cell, so the constraint can't be enforced in it.
+     * Returns false if a cell isn't in the wave.
+     */
+    template <typename F>
+    bool set_connectivity(F&& walkable_pixel,
+        const std::vector<std::pair<unsigned, unsigned>>& cells) noexcept {
+        const unsigned centre = options.pattern_size / 2;
+        walkable.assign((rules->patterns.size() + 63) / 64, 0);
+        for (unsigned p = 0; p < rules->patterns.size(); p++) {
+            if (walkable_pixel(rules->patterns[p].get(centre, centre))) {
+                walkable[p >> 6] |= uint64_t(1) << (p & 63);
+            }
+        }
+        required.clear();
+        for (auto [i, j] : cells) {
+            if (i >= options.get_wave_height() || j >= options.get_wave_width()) {
+                return false;
+            }
+            required.push_back({ i, j });
+        }
+        return true;
+    }
+
+    /**
+     * Run the WFC algorithm chunk by chunk, and return the result if every
+     * chunk could be solved.
+     */
+    std::optional<Array2D<T>> run() noexcept {
+        const unsigned height = options.get_wave_height();
+        const unsigned width = options.get_wave_width();
+        const unsigned chunk_size = std::max(chunk_options.chunk_size, 2u);
+        std::fill(solved.data.begin(), solved.data.end(), -1);
+        stats = {};
+
+        // The fixed cells that can't be walkable, such as a blank border.
+        std::fill(fixed_walkable.data.begin(), fixed_walkable.data.end(), 1);
+        for (std::size_t n = 0; n < fixed.size() && !required.empty(); n++) {
+            auto [i, j] = fixed.cells[n];
+            bool can_walk = false;
+            for (unsigned w = 0; w < fixed.nb_words; w++) {
+                can_walk = can_walk || (fixed.get_mask(n)[w] & walkable[w]) != 0;
+            }
+            fixed_walkable.get(i, j) = fixed_walkable.get(i, j) && can_walk;
+        }
+
+        for (unsigned y0 : get_chunk_starts(height)) {
+            for (unsigned x0 : get_chunk_starts(width)) {
+                const unsigned y1 = std::min(y0 + chunk_size, height);
+                const unsigned x1 = std::min(x0 + chunk_size, width);
+
+                // Every failed attempt extends the chunk over the solved cells
+                // above and to the left of it.
+                bool success = false;
+                for (unsigned attempt = 0;
+                    attempt < chunk_options.attempts_per_chunk && !success; attempt++) {
+                    unsigned margin = attempt * chunk_options.overlap;
+                    success = solve_chunk(y0 - std::min(y0, margin),
+                        x0 - std::min(x0, margin), y1, x1);
+                }
+                if (!success) {
+                    return std::nullopt;
+                }
+                if (!required.empty() && is_doomed()) {
+                    stats.nb_aborts++;
+                    return std::nullopt;
+                }
+            }
+        }
+
+        Array2D<unsigned> output_patterns(height, width);
+        for (std::size_t i = 0; i < solved.data.size(); i++) {
+            output_patterns.data[i] = static_cast<unsigned>(solved.data[i]);
+        }
+        return Model::to_image(output_patterns, rules->patterns, options);
+    }
+
+    /**
+     * Return the counters of the last run, summed over its chunks.
+     */
+    const WFCStats& get_stats() const noexcept {
+        return stats;
+    }
+
+    const OverlappingWFCOptions& get_options() const {
+        return options;
+    }
+};
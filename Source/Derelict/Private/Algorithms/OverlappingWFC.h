@@ -3,9 +3,18 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Async/ParallelFor.h"
 
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
 #include <unordered_map>
 
 #include "Algorithms/array2D.h"
@@ -23,6 +32,16 @@ struct OverlappingWFCOptions {
     bool ground;       // True if the ground needs to be set (see init_ground).
     unsigned pattern_size; // The width and height in pixel of the patterns.
 
+    /**
+     * True if the patterns that can't be placed in a cell with a neighbour in
+     * every direction are removed from the rules (see prune_patterns). They
+     * then can't be placed on the edges of the output either, so this is for
+     * periodic outputs, or outputs whose edges are set to live patterns or to
+     * the patterns kept when the rules are built.
+     */
+    bool prune_patterns;
+    WFCSolverOptions solver;   // The options of the generic WFC algorithm.
+
     /**
      * Get the wave height given these options.
      */
@@ -39,61 +58,267 @@ struct OverlappingWFCOptions {
 };
 
 /**
- * Class generating a new image with the overlapping WFC algorithm.
+ * The rules extracted from an input image: its patterns, their frequencies and
+ * which patterns can be placed next to each other. They only depend on the
+ * input and on the options used to extract them, never change once built and
+ * can be shared between threads.
+ * N is the pattern size when it is known at compile time, in which case the
+ * patterns are stored inline, or 0.
  */
-template <typename T> class OverlappingWFC {
+template <typename T, unsigned N = 0> struct OverlappingWFCRules {
+    using Pattern = std::conditional_t<N == 0, Array2D<T>, FixedArray2D<T, N>>;
+
+    std::vector<Pattern> patterns;
+    std::vector<double> frequencies;
+    std::shared_ptr<const Propagator::PropagatorState> propagator;
 
-private:
     /**
-     * The input image. T is usually a color.
+     * The id of every pattern, filled by index_patterns once patterns is set.
      */
-    Array2D<T> input;
+    std::unordered_map<Pattern, unsigned> pattern_ids;
 
     /**
-     * Options needed by the algorithm.
+     * Build pattern_ids from patterns.
      */
-    OverlappingWFCOptions options;
+    void index_patterns() noexcept {
+        pattern_ids.clear();
+        pattern_ids.reserve(patterns.size());
+        for (unsigned p = 0; p < patterns.size(); p++) {
+            pattern_ids.emplace(patterns[p], p);
+        }
+    }
 
     /**
-     * The array of the different patterns extracted from the input.
+     * Return the id of pattern, if it is one of the patterns. pattern must
+     * have the size of the patterns.
      */
-    std::vector<Array2D<T>> patterns;
+    std::optional<unsigned> find_pattern(const Array2D<T>& pattern) const noexcept {
+        auto it = pattern_ids.find(Pattern(pattern));
+        if (it == pattern_ids.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
 
     /**
-     * The underlying generic WFC algorithm.
+     * Remove the patterns found dead by Propagator::get_live_patterns, with
+     * their frequencies and compatibility lists. The patterns of kept that are
+     * patterns of the rules are never removed. The remaining patterns keep
+     * their order and are renumbered, so rules without dead patterns are left
+     * unchanged. Return the number of patterns removed.
      */
-    WFC wfc;
+    unsigned prune_patterns(const std::vector<Array2D<T>>& kept = {}) noexcept {
+        const Propagator::PropagatorState& state = *propagator;
+        std::vector<unsigned> kept_ids;
+        for (const Array2D<T>& pattern : kept) {
+            if (std::optional<unsigned> id = find_pattern(pattern)) {
+                kept_ids.push_back(*id);
+            }
+        }
+        std::vector<uint8_t> live = Propagator::get_live_patterns(state, kept_ids);
+
+        // new_ids[pattern] is the id of a live pattern once the dead ones are
+        // removed.
+        std::vector<unsigned> new_ids(patterns.size());
+        unsigned nb_live = 0;
+        for (unsigned pattern = 0; pattern < patterns.size(); pattern++) {
+            new_ids[pattern] = nb_live;
+            nb_live += live[pattern];
+        }
+        const unsigned nb_removed = static_cast<unsigned>(patterns.size()) - nb_live;
+        if (nb_removed == 0) {
+            return 0;
+        }
+
+        std::vector<Pattern> live_patterns;
+        std::vector<double> live_frequencies;
+        Propagator::PropagatorState::Lists live_lists(nb_live);
+        live_patterns.reserve(nb_live);
+        live_frequencies.reserve(nb_live);
+        for (unsigned pattern = 0; pattern < patterns.size(); pattern++) {
+            if (!live[pattern]) {
+                continue;
+            }
+            for (unsigned direction = 0; direction < 4; direction++) {
+                std::vector<unsigned>& list = live_lists[new_ids[pattern]][direction];
+                for (unsigned other : state.get(pattern, direction)) {
+                    if (live[other]) {
+                        list.push_back(new_ids[other]);
+                    }
+                }
+            }
+            live_patterns.push_back(std::move(patterns[pattern]));
+            live_frequencies.push_back(frequencies[pattern]);
+        }
+        patterns = std::move(live_patterns);
+        frequencies = std::move(live_frequencies);
+        propagator = std::make_shared<const Propagator::PropagatorState>(live_lists);
+        index_patterns();
+        return nb_removed;
+    }
 
     /**
-     * Constructor initializing the wfc.
-     * This constructor is called by the other constructors.
-     * This is necessary in order to initialize wfc only once.
+     * Return a new pattern of size pattern_size.
      */
-    OverlappingWFC(
-        const Array2D<T>& input, const OverlappingWFCOptions& options,
-        const int& seed,
-        const std::pair<std::vector<Array2D<T>>, std::vector<double>>& patterns,
-        const std::vector<std::array<std::vector<unsigned>, 4>>
-        & propagator) noexcept
-        : input(input), options(options), patterns(patterns.first),
-        wfc(options.periodic_output, seed, patterns.second, propagator,
-            options.get_wave_height(), options.get_wave_width()) {
-        // If necessary, the ground is set.
-        if (options.ground) {
-            init_ground(wfc, input, patterns.first, options);
+    static Pattern make_pattern(unsigned pattern_size) noexcept {
+        if constexpr (N == 0) {
+            return Array2D<T>(pattern_size, pattern_size);
+        }
+        else {
+            check(pattern_size == N);
+            return Pattern();
         }
     }
+};
+
+/**
+ * Cache of the rules extracted from input images, so that the patterns and
+ * compatibility lists are built once per input instead of once per run.
+ * Rules are keyed by the input contents, by the options they depend on and by
+ * the patterns kept by the pruning.
+ */
+template <typename T, unsigned N = 0> class OverlappingWFCRulesCache {
+private:
+    struct Key {
+        Array2D<T> input;
+        bool periodic_input;
+        unsigned symmetry;
+        unsigned pattern_size;
+        bool prune_patterns;
+        std::vector<Array2D<T>> kept_patterns;
+
+        bool operator==(const Key& other) const noexcept {
+            return periodic_input == other.periodic_input &&
+                symmetry == other.symmetry &&
+                pattern_size == other.pattern_size &&
+                prune_patterns == other.prune_patterns && input == other.input &&
+                kept_patterns == other.kept_patterns;
+        }
+    };
+
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const noexcept {
+            std::size_t seed = std::hash<Array2D<T>>()(key.input);
+            for (std::size_t i : { (std::size_t)key.periodic_input,
+                (std::size_t)key.symmetry, (std::size_t)key.pattern_size,
+                (std::size_t)key.prune_patterns }) {
+                seed ^= i + (std::size_t)0x9e3779b9 + (seed << 6) + (seed >> 2);
+            }
+            for (const Array2D<T>& pattern : key.kept_patterns) {
+                seed ^= std::hash<Array2D<T>>()(pattern) + (std::size_t)0x9e3779b9 +
+                    (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+
+    using Rules = std::shared_ptr<const OverlappingWFCRules<T, N>>;
+
+    static std::mutex& get_mutex() noexcept {
+        static std::mutex mutex;
+        return mutex;
+    }
 
     /**
-     * Constructor used only to call the other constructor with more computed
-     * parameters.
+     * The rules of every key, set once they are built.
      */
-    OverlappingWFC(const Array2D<T>& input, const OverlappingWFCOptions& options,
-        const int& seed,
-        const std::pair<std::vector<Array2D<T>>, std::vector<double>>
-        & patterns) noexcept
-        : OverlappingWFC(input, options, seed, patterns,
-            generate_compatible(patterns.first)) {}
+    static std::unordered_map<Key, std::shared_future<Rules>, KeyHash>& get_entries() noexcept {
+        static std::unordered_map<Key, std::shared_future<Rules>, KeyHash> entries;
+        return entries;
+    }
+
+public:
+    /**
+     * Return the rules of input with options and kept_patterns, calling
+     * build(input, options, kept_patterns) if they aren't cached yet. Only the
+     * lookup is done with the cache locked: the first caller of a key adds its
+     * entry before building the rules, and the other callers of that key wait
+     * for them, so the rules of an input are only built once even when
+     * requested by several threads.
+     */
+    template <typename F>
+    static Rules get(const Array2D<T>& input, const OverlappingWFCOptions& options,
+        const std::vector<Array2D<T>>& kept_patterns, F&& build) {
+        Key key{ input, options.periodic_input, options.symmetry,
+            options.pattern_size, options.prune_patterns, kept_patterns };
+        std::promise<Rules> promise;
+        std::shared_future<Rules> rules;
+        bool found;
+        {
+            std::lock_guard<std::mutex> lock(get_mutex());
+            auto& entries = get_entries();
+            auto it = entries.find(key);
+            found = it != entries.end();
+            if (found) {
+                rules = it->second;
+            }
+            else {
+                rules = promise.get_future().share();
+                entries.emplace(std::move(key), rules);
+            }
+        }
+        if (!found) {
+            promise.set_value(Rules(build(input, options, kept_patterns)));
+        }
+        return rules.get();
+    }
+
+    /**
+     * Cache rules for input with options and kept_patterns, for instance after
+     * loading them from a file. Rules already cached for input are kept.
+     */
+    static void insert(const Array2D<T>& input, const OverlappingWFCOptions& options,
+        const std::vector<Array2D<T>>& kept_patterns, Rules rules) {
+        Key key{ input, options.periodic_input, options.symmetry,
+            options.pattern_size, options.prune_patterns, kept_patterns };
+        std::promise<Rules> promise;
+        promise.set_value(std::move(rules));
+        std::lock_guard<std::mutex> lock(get_mutex());
+        get_entries().emplace(std::move(key), promise.get_future().share());
+    }
+
+    /**
+     * Forget every cached rules. The rules still used by a WFC, or still being
+     * built, stay alive.
+     */
+    static void clear() noexcept {
+        std::lock_guard<std::mutex> lock(get_mutex());
+        get_entries().clear();
+    }
+};
+
+/**
+ * Class generating a new image with the overlapping WFC algorithm.
+ * N is the pattern size, which must then be equal to options.pattern_size, or
+ * 0 if the pattern size is only known at runtime. With a fixed size, the
+ * patterns are stored inline and the loops over their pixels are unrolled.
+ */
+template <typename T, unsigned N = 0> class OverlappingWFC {
+public:
+    using Rules = OverlappingWFCRules<T, N>;
+    using Pattern = typename Rules::Pattern;
+
+private:
+    /**
+     * The input image. T is usually a color.
+     */
+    Array2D<T> input;
+
+    /**
+     * Options needed by the algorithm.
+     */
+    OverlappingWFCOptions options;
+
+    /**
+     * The patterns extracted from the input, their frequencies and their
+     * compatibility lists.
+     */
+    std::shared_ptr<const Rules> rules;
+
+    /**
+     * The underlying generic WFC algorithm.
+     */
+    WFC wfc;
 
     /**
      * Init the ground of the output image.
@@ -103,7 +328,7 @@ private:
      * the output image.
      */
     void init_ground(WFC& wfc_, const Array2D<T>& input_,
-        const std::vector<Array2D<T>>& patterns_,
+        const std::vector<Pattern>& patterns_,
         const OverlappingWFCOptions& options_) noexcept {
         unsigned ground_pattern_id =
             get_ground_pattern_id(input_, patterns_, options_);
@@ -129,12 +354,12 @@ private:
      */
     static unsigned
         get_ground_pattern_id(const Array2D<T>& input,
-            const std::vector<Array2D<T>>& patterns,
+            const std::vector<Pattern>& patterns,
             const OverlappingWFCOptions& options) noexcept {
         // Get the pattern.
-        Array2D<T> ground_pattern =
+        Pattern ground_pattern = Pattern(
             input.get_sub_array(input.height - 1, input.width / 2,
-                options.pattern_size, options.pattern_size);
+                options.pattern_size, options.pattern_size));
 
         // Retrieve the id of the pattern.
         for (unsigned i = 0; i < patterns.size(); i++) {
@@ -149,19 +374,213 @@ private:
     }
 
     /**
-     * Return the list of patterns, as well as their probabilities of apparition.
+     * Extract the patterns of input and build their compatibility lists. The
+     * patterns of kept_patterns are never pruned.
      */
-    static std::pair<std::vector<Array2D<T>>, std::vector<double>>
-        get_patterns(const Array2D<T>& input,
+    static std::shared_ptr<const Rules> build_rules(const Array2D<T>& input,
+        const OverlappingWFCOptions& options,
+        const std::vector<Array2D<T>>& kept_patterns = {}) noexcept {
+        check(N == 0 || options.pattern_size == N);
+        auto rules = std::make_shared<Rules>();
+        std::tie(rules->patterns, rules->frequencies) = get_patterns(input, options);
+        rules->index_patterns();
+        rules->propagator = std::make_shared<const Propagator::PropagatorState>(
+            generate_compatible(rules->patterns));
+        if (options.prune_patterns) {
+            unsigned nb_removed = rules->prune_patterns(kept_patterns);
+            UE_LOG(LogTemp, Display, TEXT("Pruned %u dead patterns, %u patterns left"),
+                nb_removed, static_cast<unsigned>(rules->patterns.size()));
+        }
+        return rules;
+    }
+
+    /**
+     * Return, for each of the 8 symmetries of a S*S pattern, the index in the
+     * pattern of every pixel of the symmetry. The symmetries are in the order
+     * used by get_patterns: the pattern, its reflection, then the rotations of
+     * the previous pair.
+     */
+    template <unsigned S>
+    static constexpr std::array<std::array<uint8_t, S * S>, 8>
+        get_symmetry_permutations() noexcept {
+        std::array<std::array<uint8_t, S * S>, 8> permutations{};
+        for (unsigned k = 0; k < S * S; k++) {
+            permutations[0][k] = static_cast<uint8_t>(k);
+        }
+        for (unsigned s = 1; s < 8; s++) {
+            for (unsigned y = 0; y < S; y++) {
+                for (unsigned x = 0; x < S; x++) {
+                    // reflected: (y, x) comes from (y, S - 1 - x).
+                    // rotated: (y, x) comes from (x, S - 1 - y).
+                    permutations[s][y * S + x] = s % 2 == 1
+                        ? permutations[s - 1][y * S + S - 1 - x]
+                        : permutations[s - 2][x * S + S - 1 - y];
+                }
+            }
+        }
+        return permutations;
+    }
+
+    /**
+     * The number of rows of the input extracted by one task of get_patterns.
+     */
+    static constexpr unsigned EXTRACTION_BAND_ROWS = 8;
+
+    /**
+     * Open addressing table from packed pattern keys to their id, at most half
+     * full. keys holds the keys in the order they were first added, and
+     * weights the sum of the weights they were added with.
+     */
+    struct PackedPatterns {
+        std::vector<uint64_t> keys;
+        std::vector<double> weights;
+        std::vector<uint64_t> table_keys;
+        std::vector<unsigned> table_ids;
+        unsigned table_bits;
+
+        static constexpr unsigned EMPTY = std::numeric_limits<unsigned>::max();
+
+        explicit PackedPatterns(std::size_t max_patterns) noexcept : table_bits(1) {
+            while ((std::size_t(1) << table_bits) < 2 * max_patterns) {
+                table_bits++;
+            }
+            table_keys.resize(std::size_t(1) << table_bits);
+            table_ids.assign(std::size_t(1) << table_bits, EMPTY);
+            keys.reserve(max_patterns);
+            weights.reserve(max_patterns);
+        }
+
+        void add(uint64_t key, double weight) noexcept {
+            const std::size_t table_mask = (std::size_t(1) << table_bits) - 1;
+            std::size_t slot =
+                (std::size_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - table_bits));
+            while (table_ids[slot] != EMPTY && table_keys[slot] != key) {
+                slot = (slot + 1) & table_mask;
+            }
+            if (table_ids[slot] != EMPTY) {
+                weights[table_ids[slot]] += weight;
+            }
+            else {
+                table_keys[slot] = key;
+                table_ids[slot] = static_cast<unsigned>(keys.size());
+                keys.push_back(key);
+                weights.push_back(weight);
+            }
+        }
+    };
+
+    /**
+     * Same as get_patterns, for S*S patterns. The colors of the input are
+     * replaced by their index in a palette, so that a pattern and its
+     * symmetries are packed in 64 bits keys, deduplicated in an open
+     * addressing table. Nothing is allocated per pixel. The bands of rows are
+     * extracted on the worker threads. Return nullopt if the palette is too
+     * large for a pattern to fit in 64 bits.
+     */
+    template <unsigned S>
+    static std::optional<std::pair<std::vector<Pattern>, std::vector<double>>>
+        get_patterns_packed(const Array2D<T>& input,
             const OverlappingWFCOptions& options) noexcept {
-        std::unordered_map<Array2D<T>, unsigned> patterns_id;
-        std::vector<Array2D<T>> patterns;
+        static constexpr std::array<std::array<uint8_t, S * S>, 8> permutations =
+            get_symmetry_permutations<S>();
 
-        // The number of time a pattern is seen in the input image.
-        std::vector<double> patterns_weight;
+        // Index every color of the input.
+        std::vector<T> palette;
+        std::unordered_map<T, uint8_t> palette_index;
+        std::vector<uint8_t> indexed(input.data.size());
+        for (std::size_t i = 0; i < input.data.size(); i++) {
+            auto res = palette_index.insert({ input.data[i],
+                static_cast<uint8_t>(palette.size()) });
+            if (res.second) {
+                if (palette.size() == 255) {
+                    return std::nullopt;
+                }
+                palette.push_back(input.data[i]);
+            }
+            indexed[i] = res.first->second;
+        }
+        unsigned bits = 1;
+        while ((std::size_t(1) << bits) < palette.size()) {
+            bits++;
+        }
+        if (S * S * bits > 64) {
+            return std::nullopt;
+        }
 
-        std::vector<Array2D<T>> symmetries(
-            8, Array2D<T>(options.pattern_size, options.pattern_size));
+        unsigned max_i = options.periodic_input ? input.height : input.height - S + 1;
+        unsigned max_j = options.periodic_input ? input.width : input.width - S + 1;
+
+        // Every band of rows is extracted in its own table.
+        const unsigned nb_bands = (max_i + EXTRACTION_BAND_ROWS - 1) / EXTRACTION_BAND_ROWS;
+        std::vector<PackedPatterns> bands;
+        bands.reserve(nb_bands);
+        for (unsigned band = 0; band < nb_bands; band++) {
+            unsigned rows = std::min(EXTRACTION_BAND_ROWS, max_i - band * EXTRACTION_BAND_ROWS);
+            bands.emplace_back((std::size_t)rows * max_j * options.symmetry);
+        }
+        ParallelFor(static_cast<int32>(nb_bands), [&](int32 band) {
+            PackedPatterns& table = bands[band];
+            const unsigned i_end = std::min(max_i, (band + 1) * EXTRACTION_BAND_ROWS);
+            uint8_t pixels[S * S];
+            for (unsigned i = band * EXTRACTION_BAND_ROWS; i < i_end; i++) {
+                for (unsigned j = 0; j < max_j; j++) {
+                    for (unsigned y = 0; y < S; y++) {
+                        for (unsigned x = 0; x < S; x++) {
+                            pixels[y * S + x] = indexed[((i + y) % input.height) * input.width +
+                                (j + x) % input.width];
+                        }
+                    }
+
+                    for (unsigned k = 0; k < options.symmetry; k++) {
+                        uint64_t key = 0;
+                        for (unsigned p = 0; p < S * S; p++) {
+                            key |= uint64_t(pixels[permutations[k][p]]) << (p * bits);
+                        }
+                        table.add(key, 1);
+                    }
+                }
+            }
+        }, nb_bands == 1);
+
+        // The bands are merged in order, so the patterns are numbered in the
+        // order they are first seen in the input, as by a single table.
+        std::size_t nb_band_patterns = 0;
+        for (const PackedPatterns& table : bands) {
+            nb_band_patterns += table.keys.size();
+        }
+        PackedPatterns merged(nb_band_patterns);
+        for (const PackedPatterns& table : bands) {
+            for (std::size_t id = 0; id < table.keys.size(); id++) {
+                merged.add(table.keys[id], table.weights[id]);
+            }
+        }
+        std::vector<uint64_t>& keys = merged.keys;
+        std::vector<double>& patterns_weight = merged.weights;
+
+        // Unpack the patterns.
+        std::vector<Pattern> patterns;
+        patterns.reserve(keys.size());
+        const uint64_t pixel_mask = (uint64_t(1) << bits) - 1;
+        for (uint64_t key : keys) {
+            Pattern pattern = Rules::make_pattern(S);
+            for (unsigned p = 0; p < S * S; p++) {
+                pattern.data[p] = palette[(key >> (p * bits)) & pixel_mask];
+            }
+            patterns.push_back(std::move(pattern));
+        }
+
+        return std::make_pair(std::move(patterns), std::move(patterns_weight));
+    }
+
+    /**
+     * Return the list of patterns, as well as their probabilities of apparition.
+     * The input is split in bands of EXTRACTION_BAND_ROWS rows, extracted on
+     * the worker threads and merged in order, so the patterns and their ids
+     * don't depend on the number of threads.
+     */
+    static std::pair<std::vector<Pattern>, std::vector<double>>
+        get_patterns(const Array2D<T>& input,
+            const OverlappingWFCOptions& options) noexcept {
         unsigned max_i = options.periodic_input
             ? input.height
             : input.height - options.pattern_size + 1;
@@ -170,40 +589,138 @@ private:
             : input.width - options.pattern_size + 1;
         UE_LOG(LogTemp, Warning, TEXT("Pattern Size: %d, Input Size: %dx%d"), options.pattern_size, input.width, input.height);
 
-        for (unsigned i = 0; i < max_i; i++) {
-            for (unsigned j = 0; j < max_j; j++) {
-                // Compute the symmetries of every pattern in the image.
-                check(symmetries.size() == 8);
-                check(options.pattern_size != 0);
-                check(input.height != 0);
-                check(input.width != 0);
-                symmetries[0].data =
-                    input
-                    .get_sub_array(i, j, options.pattern_size, options.pattern_size)
-                    .data;
-                symmetries[1].data = symmetries[0].reflected().data;
-                symmetries[2].data = symmetries[0].rotated().data;
-                symmetries[3].data = symmetries[2].reflected().data;
-                symmetries[4].data = symmetries[2].rotated().data;
-                symmetries[5].data = symmetries[4].reflected().data;
-                symmetries[6].data = symmetries[4].rotated().data;
-                symmetries[7].data = symmetries[6].reflected().data;
-
-                // The number of symmetries in the option class define which symetries
-                // will be used.
-                for (unsigned k = 0; k < options.symmetry; k++) {
-                    auto res = patterns_id.insert(
-                        std::make_pair(symmetries[k], patterns.size()));
-
-                    // If the pattern already exist, we just have to increase its number
-                    // of appearance.
-                    if (!res.second) {
-                        patterns_weight[res.first->second] += 1;
+        // Small patterns are extracted as packed keys when they fit in 64 bits.
+        std::optional<std::pair<std::vector<Pattern>, std::vector<double>>> packed;
+        if constexpr (N == 0) {
+            switch (options.pattern_size) {
+            case 2: packed = get_patterns_packed<2>(input, options); break;
+            case 3: packed = get_patterns_packed<3>(input, options); break;
+            case 4: packed = get_patterns_packed<4>(input, options); break;
+            default: break;
+            }
+        }
+        else if constexpr (N <= 4) {
+            packed = get_patterns_packed<N>(input, options);
+        }
+        if (packed.has_value()) {
+            return std::move(*packed);
+        }
+
+        // The patterns of a band in the order they are first seen, with their
+        // hash and the number of time each of them is seen in the band.
+        // shard_ids[shard] holds the ids of the patterns whose hash falls in
+        // shard, in increasing order. first[id] is set if the band is the first
+        // one to see the pattern, in which case weight[id] is its weight in the
+        // whole input.
+        struct Band {
+            std::unordered_map<Array2D<T>, unsigned> patterns_id;
+            std::vector<Array2D<T>> patterns;
+            std::vector<double> patterns_weight;
+            std::vector<std::size_t> hashes;
+            std::vector<std::vector<unsigned>> shard_ids;
+            std::vector<uint8_t> first;
+            std::vector<double> weight;
+        };
+        const unsigned nb_bands = (max_i + EXTRACTION_BAND_ROWS - 1) / EXTRACTION_BAND_ROWS;
+        const unsigned nb_shards = nb_bands;
+        std::vector<Band> bands(nb_bands);
+        ParallelFor(static_cast<int32>(nb_bands), [&](int32 band) {
+            std::unordered_map<Array2D<T>, unsigned>& patterns_id = bands[band].patterns_id;
+            std::vector<Array2D<T>>& patterns = bands[band].patterns;
+            std::vector<double>& patterns_weight = bands[band].patterns_weight;
+            std::vector<Array2D<T>> symmetries(
+                8, Array2D<T>(options.pattern_size, options.pattern_size));
+            const unsigned i_end = std::min(max_i, (band + 1) * EXTRACTION_BAND_ROWS);
+            for (unsigned i = band * EXTRACTION_BAND_ROWS; i < i_end; i++) {
+                for (unsigned j = 0; j < max_j; j++) {
+                    // Compute the symmetries of every pattern in the image.
+                    check(symmetries.size() == 8);
+                    check(options.pattern_size != 0);
+                    check(input.height != 0);
+                    check(input.width != 0);
+                    symmetries[0].data =
+                        input
+                        .get_sub_array(i, j, options.pattern_size, options.pattern_size)
+                        .data;
+                    symmetries[1].data = symmetries[0].reflected().data;
+                    symmetries[2].data = symmetries[0].rotated().data;
+                    symmetries[3].data = symmetries[2].reflected().data;
+                    symmetries[4].data = symmetries[2].rotated().data;
+                    symmetries[5].data = symmetries[4].reflected().data;
+                    symmetries[6].data = symmetries[4].rotated().data;
+                    symmetries[7].data = symmetries[6].reflected().data;
+
+                    // The number of symmetries in the option class define which symetries
+                    // will be used.
+                    for (unsigned k = 0; k < options.symmetry; k++) {
+                        auto res = patterns_id.insert(
+                            std::make_pair(symmetries[k], patterns.size()));
+
+                        // If the pattern already exist, we just have to increase its number
+                        // of appearance.
+                        if (!res.second) {
+                            patterns_weight[res.first->second] += 1;
+                        }
+                        else {
+                            patterns.push_back(symmetries[k]);
+                            patterns_weight.push_back(1);
+                        }
                     }
-                    else {
-                        patterns.push_back(symmetries[k]);
-                        patterns_weight.push_back(1);
+                }
+            }
+            patterns_id.clear();
+            Band& result = bands[band];
+            result.hashes.reserve(patterns.size());
+            result.shard_ids.resize(nb_shards);
+            for (unsigned id = 0; id < patterns.size(); id++) {
+                result.hashes.push_back(std::hash<Array2D<T>>()(patterns[id]));
+                result.shard_ids[result.hashes[id] % nb_shards].push_back(id);
+            }
+            result.first.assign(patterns.size(), 0);
+            result.weight.assign(patterns.size(), 0);
+        }, nb_bands == 1);
+
+        // The patterns are split in shards by hash, and every shard walks its
+        // patterns of every band, band by band in order, to find the first band
+        // seeing each of them and to sum its weights there. The shards don't
+        // share any pattern, so they are merged on the worker threads.
+        struct ShardKey {
+            const Array2D<T>* pattern;
+            std::size_t hash;
+            bool operator==(const ShardKey& other) const noexcept {
+                return *pattern == *other.pattern;
+            }
+        };
+        struct ShardKeyHash {
+            std::size_t operator()(const ShardKey& key) const noexcept {
+                return key.hash;
+            }
+        };
+        ParallelFor(static_cast<int32>(nb_shards), [&](int32 shard) {
+            std::unordered_map<ShardKey, std::pair<unsigned, unsigned>, ShardKeyHash> owners;
+            for (unsigned band = 0; band < nb_bands; band++) {
+                Band& current = bands[band];
+                for (unsigned id : current.shard_ids[shard]) {
+                    auto res = owners.insert({ { &current.patterns[id], current.hashes[id] },
+                        { band, id } });
+                    auto [owner_band, owner_id] = res.first->second;
+                    if (res.second) {
+                        current.first[id] = 1;
                     }
+                    bands[owner_band].weight[owner_id] += current.patterns_weight[id];
+                }
+            }
+        }, nb_shards == 1);
+
+        // The patterns are numbered in the order they are first seen in the
+        // input, as by a serial extraction.
+        std::vector<Pattern> patterns;
+        std::vector<double> patterns_weight;
+        for (Band& band : bands) {
+            for (std::size_t id = 0; id < band.patterns.size(); id++) {
+                if (band.first[id]) {
+                    patterns.push_back(Pattern(std::move(band.patterns[id])));
+                    patterns_weight.push_back(band.weight[id]);
                 }
             }
         }
@@ -215,7 +732,7 @@ private:
      * Return true if the pattern1 is compatible with pattern2
      * when pattern2 is at a distance (dy,dx) from pattern1.
      */
-    static bool agrees(const Array2D<T>& pattern1, const Array2D<T>& pattern2,
+    static bool agrees(const Pattern& pattern1, const Pattern& pattern2,
         int dy, int dx) noexcept {
         unsigned xmin = dx < 0 ? 0 : dx;
         unsigned xmax = dx < 0 ? dx + pattern2.width : pattern1.width;
@@ -234,109 +751,108 @@ private:
         return true;
     }
 
+    /**
+     * Return the part of pattern that overlaps a pattern placed at a distance
+     * (dy, dx) from it, i.e. the pixels compared by agrees(pattern, other, dy, dx).
+     * The pixels of other compared by agrees are its overlap at (-dy, -dx).
+     */
+    static Array2D<T> get_overlap(const Pattern& pattern, int dy, int dx) noexcept {
+        unsigned xmin = dx < 0 ? 0 : dx;
+        unsigned xmax = dx < 0 ? dx + pattern.width : pattern.width;
+        unsigned ymin = dy < 0 ? 0 : dy;
+        unsigned ymax = dy < 0 ? dy + pattern.height : pattern.height;
+
+        Array2D<T> overlap(ymax - ymin, xmax - xmin);
+        for (unsigned y = ymin; y < ymax; y++) {
+            for (unsigned x = xmin; x < xmax; x++) {
+                overlap.get(y - ymin, x - xmin) = pattern.get(y, x);
+            }
+        }
+        return overlap;
+    }
+
     /**
      * Precompute the function agrees(pattern1, pattern2, dy, dx).
      * If agrees(pattern1, pattern2, dy, dx), then compatible[pattern1][direction]
      * contains pattern2, where direction is the direction defined by (dy, dx)
      * (see direction.hpp).
+     * Two patterns agree exactly when their overlaps are equal, so instead of
+     * comparing every pair, the patterns are grouped by overlap and pattern1 is
+     * compatible with the group of its own overlap. The lists are sorted, as
+     * they would be by comparing every pair.
      */
     static std::vector<std::array<std::vector<unsigned>, 4>>
-        generate_compatible(const std::vector<Array2D<T>>& patterns) noexcept {
+        generate_compatible(const std::vector<Pattern>& patterns) noexcept {
         std::vector<std::array<std::vector<unsigned>, 4>> compatible =
             std::vector<std::array<std::vector<unsigned>, 4>>(patterns.size());
+        const int32 nb_patterns = static_cast<int32>(patterns.size());
 
-        // Iterate on every dy, dx, pattern1 and pattern2
-        for (unsigned pattern1 = 0; pattern1 < patterns.size(); pattern1++) {
+        // overlaps[pattern * 4 + direction] is the overlap of pattern with a
+        // pattern in direction.
+        std::vector<Array2D<T>> overlaps(patterns.size() * 4);
+        ParallelFor(nb_patterns, [&](int32 pattern) {
             for (unsigned direction = 0; direction < 4; direction++) {
-                for (unsigned pattern2 = 0; pattern2 < patterns.size(); pattern2++) {
-                    if (agrees(patterns[pattern1], patterns[pattern2],
-                        directions_y[direction], directions_x[direction])) {
-                        compatible[pattern1][direction].push_back(pattern2);
-                    }
-                }
+                overlaps[pattern * 4 + direction] = get_overlap(patterns[pattern],
+                    directions_y[direction], directions_x[direction]);
             }
-        }
+        });
 
-        return compatible;
-    }
-
-    /**
-     * Transform a 2D array containing the patterns id to a 2D array containing
-     * the pixels.
-     */
-    Array2D<T> to_image(const Array2D<unsigned>& output_patterns) const noexcept {
-        Array2D<T> output = Array2D<T>(options.out_height, options.out_width);
-
-        if (options.periodic_output) {
-            for (unsigned y = 0; y < options.get_wave_height(); y++) {
-                for (unsigned x = 0; x < options.get_wave_width(); x++) {
-                    output.get(y, x) = patterns[output_patterns.get(y, x)].get(0, 0);
-                }
+        for (unsigned direction = 0; direction < 4; direction++) {
+            // The patterns that can be placed in direction, grouped by the
+            // overlap they must match. They are added in increasing order.
+            unsigned opposite = get_opposite_direction(direction);
+            std::unordered_map<Array2D<T>, std::vector<unsigned>> groups;
+            for (unsigned pattern2 = 0; pattern2 < patterns.size(); pattern2++) {
+                groups[overlaps[pattern2 * 4 + opposite]].push_back(pattern2);
             }
-        }
-        else {
-            for (unsigned y = 0; y < options.get_wave_height(); y++) {
-                for (unsigned x = 0; x < options.get_wave_width(); x++) {
-                    output.get(y, x) = patterns[output_patterns.get(y, x)].get(0, 0);
-                }
-            }
-            for (unsigned y = 0; y < options.get_wave_height(); y++) {
-                const Array2D<T>& pattern =
-                    patterns[output_patterns.get(y, options.get_wave_width() - 1)];
-                for (unsigned dx = 1; dx < options.pattern_size; dx++) {
-                    output.get(y, options.get_wave_width() - 1 + dx) = pattern.get(0, dx);
-                }
-            }
-            for (unsigned x = 0; x < options.get_wave_width(); x++) {
-                const Array2D<T>& pattern =
-                    patterns[output_patterns.get(options.get_wave_height() - 1, x)];
-                for (unsigned dy = 1; dy < options.pattern_size; dy++) {
-                    output.get(options.get_wave_height() - 1 + dy, x) =
-                        pattern.get(dy, 0);
-                }
-            }
-            const Array2D<T>& pattern = patterns[output_patterns.get(
-                options.get_wave_height() - 1, options.get_wave_width() - 1)];
-            for (unsigned dy = 1; dy < options.pattern_size; dy++) {
-                for (unsigned dx = 1; dx < options.pattern_size; dx++) {
-                    output.get(options.get_wave_height() - 1 + dy,
-                        options.get_wave_width() - 1 + dx) = pattern.get(dy, dx);
-                }
-            }
-        }
 
-        return output;
-    }
-
-    std::optional<unsigned> get_pattern_id(const Array2D<T>& pattern) {
-        auto pattern_id = std::find(patterns.begin(), patterns.end(), pattern);
-
-        if (pattern_id != patterns.end()) {
-            return std::distance(patterns.begin(), pattern_id);
+            ParallelFor(nb_patterns, [&](int32 pattern1) {
+                auto group = groups.find(overlaps[pattern1 * 4 + direction]);
+                if (group != groups.end()) {
+                    compatible[pattern1][direction] = group->second;
+                }
+            });
         }
 
-        return std::nullopt;
+        return compatible;
     }
 
+public:
     /**
-     * Set the pattern at a specific position, given its pattern id
-     * pattern_id needs to be a valid pattern id, and i and j needs to be in the wave range
+     * Constructor using rules already extracted from input with options, which
+     * only allocates the wave.
      */
-    void set_pattern(unsigned pattern_id, unsigned i, unsigned j) noexcept {
-        for (unsigned p = 0; p < patterns.size(); p++) {
-            if (pattern_id != p) {
-                wfc.remove_wave_pattern(i, j, p);
-            }
+    OverlappingWFC(const Array2D<T>& input, const OverlappingWFCOptions& options,
+        int seed, std::shared_ptr<const Rules> rules) noexcept
+        : input(input), options(options), rules(std::move(rules)),
+        wfc(options.periodic_output, seed, this->rules->frequencies,
+            this->rules->propagator, options.get_wave_height(),
+            options.get_wave_width(), options.solver) {
+        check(N == 0 || options.pattern_size == N);
+        // If necessary, the ground is set.
+        if (options.ground) {
+            init_ground(wfc, input, this->rules->patterns, options);
         }
     }
 
-public:
     /**
-     * The constructor used by the user.
+     * The constructor used by the user. The rules of input are taken from the
+     * cache, and only extracted the first time input is used.
      */
     OverlappingWFC(const Array2D<T>& input, const OverlappingWFCOptions& options,
         int seed) noexcept
-        : OverlappingWFC(input, options, seed, get_patterns(input, options)) {}
+        : OverlappingWFC(input, options, seed, get_rules(input, options)) {}
+
+    /**
+     * Return the rules of input with options, from the cache. The patterns of
+     * kept_patterns, such as the patterns set on the edges of the output, are
+     * never pruned. They must have the size of the patterns.
+     */
+    static std::shared_ptr<const Rules> get_rules(const Array2D<T>& input,
+        const OverlappingWFCOptions& options,
+        const std::vector<Array2D<T>>& kept_patterns = {}) noexcept {
+        return OverlappingWFCRulesCache<T, N>::get(input, options, kept_patterns, build_rules);
+    }
 
     /**
      * Set the pattern at a specific position.
@@ -364,18 +880,193 @@ public:
         return true;
     }
 
+    /**
+     * Set the pattern at a specific position, given its pattern id
+     * pattern_id needs to be a valid pattern id, and i and j needs to be in the wave range
+     */
+    void set_pattern(unsigned pattern_id, unsigned i, unsigned j) noexcept {
+        WFCConstraints constraints(rules->patterns.size());
+        constraints.add(i, j, pattern_id);
+        wfc.constrain(i, j, constraints.get_mask(0));
+    }
+
+    /**
+     * Return the id of pattern, from the index of the rules.
+     */
+    std::optional<unsigned> get_pattern_id(const Array2D<T>& pattern) const noexcept {
+        if (pattern.height != get_pattern_size() || pattern.width != get_pattern_size()) {
+            return std::nullopt;
+        }
+        return rules->find_pattern(pattern);
+    }
+
+    /**
+     * Return an empty batch of constraints for this wave.
+     */
+    WFCConstraints make_constraints() const noexcept {
+        return WFCConstraints(rules->patterns.size());
+    }
+
+    /**
+     * Add to constraints the pattern pattern_id at cell (i, j) of the wave.
+     * Returns false if the cell isn't in the wave.
+     */
+    bool add_constraint(WFCConstraints& constraints, unsigned pattern_id,
+        unsigned i, unsigned j) const noexcept {
+        if (i >= options.get_wave_height() || j >= options.get_wave_width()) {
+            return false;
+        }
+        constraints.add(i, j, pattern_id);
+        return true;
+    }
+
+    /**
+     * Apply every constraint at once and propagate them.
+     * Returns false if the wave is then in contradiction.
+     */
+    bool apply_constraints(const WFCConstraints& constraints) noexcept {
+        return wfc.apply_constraints(constraints);
+    }
+
+    /**
+     * Return the state of the wave once the constraints are applied, to skip
+     * them in the waves of other seeds with the same options (see WFCSnapshot).
+     */
+    WFCSnapshot snapshot() const noexcept {
+        return wfc.snapshot();
+    }
+
+    /**
+     * Replace the state of the wave with a snapshot taken with the same rules
+     * and options, before the run.
+     */
+    void restore_snapshot(const WFCSnapshot& snapshot) noexcept {
+        wfc.restore_snapshot(snapshot);
+    }
+
+    /**
+     * Require the cells (i, j) of the wave to stay connected during the run,
+     * through the cells whose pattern has a centre pixel p with walkable(p).
+     * The centre pixel of cell (i, j) is the pixel
+     * (i + pattern_size / 2, j + pattern_size / 2) of the output.
+     * Returns false if a cell isn't in the wave.
+     * With an abort_interval, the run is aborted instead when they can't be
+     * connected anymore (see WFCConnectivity).
+     */
+    template <typename F>
+    bool set_connectivity(F&& walkable,
+        const std::vector<std::pair<unsigned, unsigned>>& cells,
+        unsigned abort_interval = 0) noexcept {
+        const unsigned centre = get_pattern_size() / 2;
+        WFCConnectivity connectivity;
+        connectivity.abort_interval = abort_interval;
+        connectivity.walkable.assign((rules->patterns.size() + 63) / 64, 0);
+        for (unsigned p = 0; p < rules->patterns.size(); p++) {
+            if (walkable(rules->patterns[p].get(centre, centre))) {
+                connectivity.walkable[p >> 6] |= uint64_t(1) << (p & 63);
+            }
+        }
+        for (auto [i, j] : cells) {
+            if (i >= options.get_wave_height() || j >= options.get_wave_width()) {
+                return false;
+            }
+            connectivity.required.push_back(i * options.get_wave_width() + j);
+        }
+        wfc.set_connectivity(std::move(connectivity));
+        return true;
+    }
+
     /**
      * Run the WFC algorithm, and return the result if the algorithm succeeded.
      */
     std::optional<Array2D<T>> run() noexcept {
-        std::optional<Array2D<unsigned>> result = wfc.run();
+        std::optional<Array2D<unsigned>> result = run_pattern_ids();
         if (result.has_value()) {
-            return to_image(*result);
+            return to_image(*result, rules->patterns, options);
         }
         return std::nullopt;
     }
 
+    /**
+     * Run the WFC algorithm, and return the id of the pattern chosen for every
+     * cell of the wave if the algorithm succeeded.
+     */
+    std::optional<Array2D<unsigned>> run_pattern_ids() noexcept {
+        return wfc.run();
+    }
+
+    /**
+     * Return the counters of the last run.
+     */
+    const WFCStats& get_stats() const noexcept {
+        return wfc.get_stats();
+    }
+
+    /**
+     * Transform a 2D array containing the patterns id to a 2D array containing
+     * the pixels, for an output described by options.
+     */
+    static Array2D<T> to_image(const Array2D<unsigned>& output_patterns,
+        const std::vector<Pattern>& patterns,
+        const OverlappingWFCOptions& options) noexcept {
+        const unsigned pattern_size = N != 0 ? N : options.pattern_size;
+        Array2D<T> output = Array2D<T>(options.out_height, options.out_width);
+
+        if (options.periodic_output) {
+            for (unsigned y = 0; y < options.get_wave_height(); y++) {
+                for (unsigned x = 0; x < options.get_wave_width(); x++) {
+                    output.get(y, x) = patterns[output_patterns.get(y, x)].get(0, 0);
+                }
+            }
+        }
+        else {
+            for (unsigned y = 0; y < options.get_wave_height(); y++) {
+                for (unsigned x = 0; x < options.get_wave_width(); x++) {
+                    output.get(y, x) = patterns[output_patterns.get(y, x)].get(0, 0);
+                }
+            }
+            for (unsigned y = 0; y < options.get_wave_height(); y++) {
+                const Pattern& pattern =
+                    patterns[output_patterns.get(y, options.get_wave_width() - 1)];
+                for (unsigned dx = 1; dx < pattern_size; dx++) {
+                    output.get(y, options.get_wave_width() - 1 + dx) = pattern.get(0, dx);
+                }
+            }
+            for (unsigned x = 0; x < options.get_wave_width(); x++) {
+                const Pattern& pattern =
+                    patterns[output_patterns.get(options.get_wave_height() - 1, x)];
+                for (unsigned dy = 1; dy < pattern_size; dy++) {
+                    output.get(options.get_wave_height() - 1 + dy, x) =
+                        pattern.get(dy, 0);
+                }
+            }
+            const Pattern& pattern = patterns[output_patterns.get(
+                options.get_wave_height() - 1, options.get_wave_width() - 1)];
+            for (unsigned dy = 1; dy < pattern_size; dy++) {
+                for (unsigned dx = 1; dx < pattern_size; dx++) {
+                    output.get(options.get_wave_height() - 1 + dy,
+                        options.get_wave_width() - 1 + dx) = pattern.get(dy, dx);
+                }
+            }
+        }
+
+        return output;
+    }
+
+
     const OverlappingWFCOptions& get_options() const {
         return options;
     }
+
+    /**
+     * Return the width and height in pixel of the patterns.
+     */
+    unsigned get_pattern_size() const noexcept {
+        if constexpr (N != 0) {
+            return N;
+        }
+        else {
+            return options.pattern_size;
+        }
+    }
 };
\ No newline at end of file
@@ -0,0 +1,342 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "Algorithms/array3D.h"
+#include "Algorithms/WFC3D.h"
+
+/**
+ * Options needed to use the overlapping wfc on volumes.
+ * Volumes are Array3D<T>(decks, height, width), indexed get(z, y, x), so the
+ * voxels of a row are contiguous.
+ */
+struct OverlappingWFC3DOptions {
+    bool periodic_input;  // True if the input is toric.
+    bool periodic_output; // True if the output is toric.
+    unsigned out_depth;   // The number of decks of the output.
+    unsigned out_height;  // The height of the output in voxels.
+    unsigned out_width;   // The width of the output in voxels.
+
+    /**
+     * The number of symmetries: 1, 2, 4 or 8. The decks always stay
+     * horizontal, so the symmetries are the rotations around the vertical
+     * axis and their reflections, in the same order as in OverlappingWFC.
+     */
+    unsigned symmetry;
+    unsigned pattern_size;  // The width and height in voxels of the patterns.
+    unsigned pattern_depth; // The number of decks of the patterns.
+    WFCSolverOptions solver; // The options of the generic WFC algorithm.
+
+    /**
+     * Get the wave size given these options.
+     */
+    unsigned get_wave_depth() const noexcept {
+        return periodic_output ? out_depth : out_depth - pattern_depth + 1;
+    }
+
+    unsigned get_wave_height() const noexcept {
+        return periodic_output ? out_height : out_height - pattern_size + 1;
+    }
+
+    unsigned get_wave_width() const noexcept {
+        return periodic_output ? out_width : out_width - pattern_size + 1;
+    }
+};
+
+/**
+ * The rules extracted from an input volume, see OverlappingWFCRules.
+ */
+template <typename T> struct OverlappingWFC3DRules {
+    std::vector<Array3D<T>> patterns;
+    std::vector<double> frequencies;
+    std::shared_ptr<const Propagator3D::PropagatorState> propagator;
+};
+
+/**
+ * Class generating a new volume with the overlapping WFC algorithm, to
+ * generate several decks at once with the shafts between them.
+ */
+template <typename T> class OverlappingWFC3D {
+public:
+    using Rules = OverlappingWFC3DRules<T>;
+
+private:
+    /**
+     * Options needed by the algorithm.
+     */
+    OverlappingWFC3DOptions options;
+
+    /**
+     * The patterns extracted from the input, their frequencies and their
+     * compatibility lists.
+     */
+    std::shared_ptr<const Rules> rules;
+
+    /**
+     * The underlying generic WFC algorithm.
+     */
+    WFC3D wfc;
+
+    /**
+     * Return pattern reflected along the x axis, deck by deck.
+     */
+    static Array3D<T> reflected(const Array3D<T>& pattern) noexcept {
+        Array3D<T> result(pattern.height, pattern.width, pattern.depth);
+        for (std::size_t z = 0; z < pattern.height; z++) {
+            for (std::size_t y = 0; y < pattern.width; y++) {
+                for (std::size_t x = 0; x < pattern.depth; x++) {
+                    result.get(z, y, x) = pattern.get(z, y, pattern.depth - 1 - x);
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Return pattern rotated 90° anticlockwise around the vertical axis.
+     */
+    static Array3D<T> rotated(const Array3D<T>& pattern) noexcept {
+        Array3D<T> result(pattern.height, pattern.depth, pattern.width);
+        for (std::size_t z = 0; z < pattern.height; z++) {
+            for (std::size_t y = 0; y < pattern.depth; y++) {
+                for (std::size_t x = 0; x < pattern.width; x++) {
+                    result.get(z, y, x) = pattern.get(z, x, pattern.depth - 1 - y);
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Return the list of patterns, as well as their probabilities of apparition.
+     */
+    static std::pair<std::vector<Array3D<T>>, std::vector<double>>
+        get_patterns(const Array3D<T>& input,
+            const OverlappingWFC3DOptions& options) noexcept {
+        std::unordered_map<Array3D<T>, unsigned> patterns_id;
+        std::vector<Array3D<T>> patterns;
+
+        // The number of time a pattern is seen in the input volume.
+        std::vector<double> patterns_weight;
+
+        const unsigned size = options.pattern_size;
+        const unsigned pattern_depth = options.pattern_depth;
+        unsigned max_z = options.periodic_input ? input.height : input.height - pattern_depth + 1;
+        unsigned max_y = options.periodic_input ? input.width : input.width - size + 1;
+        unsigned max_x = options.periodic_input ? input.depth : input.depth - size + 1;
+
+        std::vector<Array3D<T>> symmetries(8, Array3D<T>(pattern_depth, size, size));
+        for (unsigned i = 0; i < max_z; i++) {
+            for (unsigned j = 0; j < max_y; j++) {
+                for (unsigned k = 0; k < max_x; k++) {
+                    for (unsigned z = 0; z < pattern_depth; z++) {
+                        for (unsigned y = 0; y < size; y++) {
+                            for (unsigned x = 0; x < size; x++) {
+                                symmetries[0].get(z, y, x) = input.get((i + z) % input.height,
+                                    (j + y) % input.width, (k + x) % input.depth);
+                            }
+                        }
+                    }
+                    symmetries[1] = reflected(symmetries[0]);
+                    symmetries[2] = rotated(symmetries[0]);
+                    symmetries[3] = reflected(symmetries[2]);
+                    symmetries[4] = rotated(symmetries[2]);
+                    symmetries[5] = reflected(symmetries[4]);
+                    symmetries[6] = rotated(symmetries[4]);
+                    symmetries[7] = reflected(symmetries[6]);
+
+                    for (unsigned s = 0; s < options.symmetry; s++) {
+                        auto res = patterns_id.insert(
+                            std::make_pair(symmetries[s], static_cast<unsigned>(patterns.size())));
+                        if (!res.second) {
+                            patterns_weight[res.first->second] += 1;
+                        }
+                        else {
+                            patterns.push_back(symmetries[s]);
+                            patterns_weight.push_back(1);
+                        }
+                    }
+                }
+            }
+        }
+
+        return { patterns, patterns_weight };
+    }
+
+    /**
+     * Return the part of pattern that overlaps a pattern placed at a distance
+     * (dz, dy, dx) from it. Two patterns agree exactly when their overlaps
+     * with each other are equal.
+     */
+    static Array3D<T> get_overlap(const Array3D<T>& pattern, int dz, int dy, int dx) noexcept {
+        unsigned zmin = dz < 0 ? 0 : dz;
+        unsigned zmax = dz < 0 ? dz + pattern.height : pattern.height;
+        unsigned ymin = dy < 0 ? 0 : dy;
+        unsigned ymax = dy < 0 ? dy + pattern.width : pattern.width;
+        unsigned xmin = dx < 0 ? 0 : dx;
+        unsigned xmax = dx < 0 ? dx + pattern.depth : pattern.depth;
+
+        Array3D<T> overlap(zmax - zmin, ymax - ymin, xmax - xmin);
+        for (unsigned z = zmin; z < zmax; z++) {
+            for (unsigned y = ymin; y < ymax; y++) {
+                for (unsigned x = xmin; x < xmax; x++) {
+                    overlap.get(z - zmin, y - ymin, x - xmin) = pattern.get(z, y, x);
+                }
+            }
+        }
+        return overlap;
+    }
+
+    /**
+     * Build the compatibility lists in the 6 directions, grouping the patterns
+     * by overlap as in OverlappingWFC::generate_compatible. The lists are
+     * sorted.
+     */
+    static Propagator3D::PropagatorState generate_compatible(
+        const std::vector<Array3D<T>>& patterns) noexcept {
+        Propagator3D::PropagatorState compatible(patterns.size());
+        for (unsigned direction = 0; direction < 6; direction++) {
+            const int dz = directions_3d_z[direction];
+            const int dy = directions_3d_y[direction];
+            const int dx = directions_3d_x[direction];
+            std::unordered_map<Array3D<T>, std::vector<unsigned>> groups;
+            for (unsigned pattern2 = 0; pattern2 < patterns.size(); pattern2++) {
+                groups[get_overlap(patterns[pattern2], -dz, -dy, -dx)].push_back(pattern2);
+            }
+            for (unsigned pattern1 = 0; pattern1 < patterns.size(); pattern1++) {
+                auto group = groups.find(get_overlap(patterns[pattern1], dz, dy, dx));
+                if (group != groups.end()) {
+                    compatible[pattern1][direction] = group->second;
+                }
+            }
+        }
+        return compatible;
+    }
+
+    /**
+     * Return the cell whose pattern holds voxel (z, y, x), and the position of
+     * the voxel in that pattern.
+     */
+    std::array<unsigned, 6> get_voxel_cell(unsigned z, unsigned y, unsigned x) const noexcept {
+        unsigned cz = std::min(z, options.get_wave_depth() - 1);
+        unsigned cy = std::min(y, options.get_wave_height() - 1);
+        unsigned cx = std::min(x, options.get_wave_width() - 1);
+        return { cz, cy, cx, z - cz, y - cy, x - cx };
+    }
+
+public:
+    /**
+     * Constructor using rules already extracted from an input with options,
+     * which only allocates the wave.
+     */
+    OverlappingWFC3D(const OverlappingWFC3DOptions& options, int seed,
+        std::shared_ptr<const Rules> rules) noexcept
+        : options(options), rules(std::move(rules)),
+        wfc(options.periodic_output, seed, this->rules->frequencies,
+            this->rules->propagator, options.get_wave_depth(),
+            options.get_wave_height(), options.get_wave_width(), options.solver) {}
+
+    /**
+     * Constructor extracting the rules of input. Build the rules once with
+     * make_rules to run several times on the same input.
+     */
+    OverlappingWFC3D(const Array3D<T>& input, const OverlappingWFC3DOptions& options,
+        int seed) noexcept
+        : OverlappingWFC3D(options, seed, make_rules(input, options)) {}
+
+    /**
+     * Extract the patterns of input and build their compatibility lists.
+     */
+    static std::shared_ptr<const Rules> make_rules(const Array3D<T>& input,
+        const OverlappingWFC3DOptions& options) noexcept {
+        check(options.symmetry >= 1 && options.symmetry <= 8);
+        auto rules = std::make_shared<Rules>();
+        std::tie(rules->patterns, rules->frequencies) = get_patterns(input, options);
+        rules->propagator = std::make_shared<const Propagator3D::PropagatorState>(
+            generate_compatible(rules->patterns));
+        return rules;
+    }
+
+    /**
+     * Set the pattern pattern_id at cell (z, y, x) of the wave.
+     */
+    void set_pattern(unsigned pattern_id, unsigned z, unsigned y, unsigned x) noexcept {
+        for (unsigned p = 0; p < rules->patterns.size(); p++) {
+            if (pattern_id != p) {
+                wfc.remove_wave_pattern(z, y, x, p);
+            }
+        }
+    }
+
+    /**
+     * Force voxel (z, y, x) of the output to value, by removing the patterns
+     * of the cell holding it that have another value there. Returns false if
+     * the voxel isn't in the output.
+     */
+    bool set_voxel(const T& value, unsigned z, unsigned y, unsigned x) noexcept {
+        if (z >= options.out_depth || y >= options.out_height || x >= options.out_width) {
+            return false;
+        }
+        auto [cz, cy, cx, oz, oy, ox] = get_voxel_cell(z, y, x);
+        for (unsigned p = 0; p < rules->patterns.size(); p++) {
+            if (!(rules->patterns[p].get(oz, oy, ox) == value)) {
+                wfc.remove_wave_pattern(cz, cy, cx, p);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Run the WFC algorithm, and return the result if the algorithm succeeded.
+     */
+    std::optional<Array3D<T>> run() noexcept {
+        std::optional<Array3D<unsigned>> result = wfc.run();
+        if (result.has_value()) {
+            return to_volume(*result);
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Transform the pattern ids of every cell of the wave to the voxels of
+     * the output.
+     */
+    Array3D<T> to_volume(const Array3D<unsigned>& output_patterns) const noexcept {
+        Array3D<T> output(options.out_depth, options.out_height, options.out_width);
+        for (unsigned z = 0; z < options.out_depth; z++) {
+            for (unsigned y = 0; y < options.out_height; y++) {
+                for (unsigned x = 0; x < options.out_width; x++) {
+                    auto [cz, cy, cx, oz, oy, ox] = get_voxel_cell(z, y, x);
+                    output.get(z, y, x) =
+                        rules->patterns[output_patterns.get(cz, cy, cx)].get(oz, oy, ox);
+                }
+            }
+        }
+        return output;
+    }
+
+    /**
+     * Return the counters of the last run.
+     */
+    const WFCStats& get_stats() const noexcept {
+        return wfc.get_stats();
+    }
+
+    const OverlappingWFC3DOptions& get_options() const {
+        return options;
+    }
+
+    const Rules& get_rules() const noexcept {
+        return *rules;
+    }
+};
@@ -0,0 +1,272 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/MappedFileHandle.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "Algorithms/array2D.h"
+#include "Algorithms/OverlappingWFC.h"
+
+/**
+ * Binary file holding the rules extracted from an input image, so they can be
+ * compiled once offline instead of being extracted on every launch.
+ *
+ * The file starts with a Header, followed by these sections, each aligned on
+ * 8 bytes:
+ * - the input image, input_height * input_width pixels,
+ * - the patterns kept by the pruning, nb_kept * pattern_size * pattern_size
+ *   pixels,
+ * - the patterns, nb_patterns * pattern_size * pattern_size pixels,
+ * - the frequencies, nb_patterns doubles,
+ * - the offsets of the compatibility lists, nb_patterns * 4 + 1 uint32, where
+ *   the list of (pattern, direction) is ids[offsets[pattern * 4 + direction]]
+ *   to ids[offsets[pattern * 4 + direction + 1]],
+ * - the ids of the compatible patterns, nb_ids uint16.
+ * Values are stored in the native byte order. The file is mapped in memory and
+ * the compatibility lists, most of it, are used in place by the propagators:
+ * the mapping lives as long as the rules. The patterns and the frequencies are
+ * copied out of it, and the lists are checked once when the file is loaded.
+ */
+template <typename T, unsigned N = 0> class OverlappingWFCRulesFile {
+public:
+    static constexpr uint32_t MAGIC = 0x52434657; // "WFCR"
+    static constexpr uint32_t VERSION = 4;
+
+private:
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t pixel_size;
+        uint32_t periodic_input;
+        uint32_t symmetry;
+        uint32_t pattern_size;
+        uint32_t prune_patterns;
+        uint32_t input_height;
+        uint32_t input_width;
+        uint32_t nb_kept;
+        uint32_t nb_patterns;
+        uint32_t nb_ids;
+    };
+
+    /**
+     * The position of every section in the file, and the size of the file.
+     */
+    struct Layout {
+        std::size_t input;
+        std::size_t kept;
+        std::size_t patterns;
+        std::size_t frequencies;
+        std::size_t offsets;
+        std::size_t ids;
+        std::size_t size;
+
+        explicit Layout(const Header& header) noexcept {
+            std::size_t pattern_pixels =
+                (std::size_t)header.pattern_size * header.pattern_size;
+            input = align(sizeof(Header));
+            kept = align(input +
+                (std::size_t)header.input_height * header.input_width * sizeof(T));
+            patterns = align(kept + header.nb_kept * pattern_pixels * sizeof(T));
+            frequencies = align(patterns +
+                header.nb_patterns * pattern_pixels * sizeof(T));
+            offsets = align(frequencies + header.nb_patterns * sizeof(double));
+            ids = align(offsets +
+                ((std::size_t)header.nb_patterns * 4 + 1) * sizeof(uint32_t));
+            size = ids + (std::size_t)header.nb_ids * sizeof(uint16_t);
+        }
+
+        static std::size_t align(std::size_t position) noexcept {
+            return (position + 7) & ~(std::size_t)7;
+        }
+    };
+
+    /**
+     * A mapped file, the region being unmapped before the file is closed.
+     */
+    struct MappedFile {
+        TUniquePtr<IMappedFileHandle> handle;
+        TUniquePtr<IMappedFileRegion> region;
+    };
+
+    /**
+     * Return the rules described by the mapped file, or nullptr if the file is
+     * invalid or wasn't compiled from input with options and kept. The rules
+     * keep storage, which holds data, alive.
+     */
+    static std::shared_ptr<const OverlappingWFCRules<T, N>> read(const uint8_t* data,
+        std::size_t size, const Array2D<T>& input, const OverlappingWFCOptions& options,
+        const std::vector<Array2D<T>>& kept, std::shared_ptr<const void> storage) noexcept {
+        if (size < sizeof(Header)) {
+            return nullptr;
+        }
+        Header header;
+        std::memcpy(&header, data, sizeof(Header));
+        if (header.magic != MAGIC || header.version != VERSION ||
+            header.pixel_size != sizeof(T) ||
+            header.periodic_input != (uint32_t)options.periodic_input ||
+            header.symmetry != options.symmetry ||
+            header.pattern_size != options.pattern_size ||
+            header.prune_patterns != (uint32_t)options.prune_patterns ||
+            header.input_height != input.height ||
+            header.input_width != input.width ||
+            header.nb_kept != kept.size()) {
+            return nullptr;
+        }
+        Layout layout(header);
+        if (layout.size > size) {
+            return nullptr;
+        }
+
+        // A file compiled from another version of the input is stale.
+        const T* input_pixels = reinterpret_cast<const T*>(data + layout.input);
+        if (!std::equal(input.data.begin(), input.data.end(), input_pixels)) {
+            return nullptr;
+        }
+
+        // So is a file whose pruning kept other patterns.
+        const std::size_t kept_pixels = (std::size_t)header.pattern_size * header.pattern_size;
+        const T* kept_data = reinterpret_cast<const T*>(data + layout.kept);
+        for (const Array2D<T>& pattern : kept) {
+            if (pattern.data.size() != kept_pixels ||
+                !std::equal(pattern.data.begin(), pattern.data.end(), kept_data)) {
+                return nullptr;
+            }
+            kept_data += kept_pixels;
+        }
+
+        const unsigned nb_patterns = header.nb_patterns;
+        const unsigned pattern_pixels = header.pattern_size * header.pattern_size;
+        const T* pattern_data = reinterpret_cast<const T*>(data + layout.patterns);
+        const double* frequencies =
+            reinterpret_cast<const double*>(data + layout.frequencies);
+        const uint32_t* offsets = reinterpret_cast<const uint32_t*>(data + layout.offsets);
+        const uint16_t* ids = reinterpret_cast<const uint16_t*>(data + layout.ids);
+
+        if (nb_patterns > Propagator::PropagatorState::MAX_PATTERNS ||
+            offsets[0] != 0 || offsets[nb_patterns * 4] != header.nb_ids) {
+            return nullptr;
+        }
+        for (unsigned i = 0; i < nb_patterns * 4; i++) {
+            if (offsets[i] > offsets[i + 1]) {
+                return nullptr;
+            }
+        }
+        for (unsigned i = 0; i < header.nb_ids; i++) {
+            if (ids[i] >= nb_patterns) {
+                return nullptr;
+            }
+        }
+
+        auto rules = std::make_shared<OverlappingWFCRules<T, N>>();
+        rules->patterns.reserve(nb_patterns);
+        for (unsigned pattern = 0; pattern < nb_patterns; pattern++) {
+            auto array = OverlappingWFCRules<T, N>::make_pattern(header.pattern_size);
+            std::copy(pattern_data + pattern * pattern_pixels,
+                pattern_data + (pattern + 1) * pattern_pixels, array.data.begin());
+            rules->patterns.push_back(std::move(array));
+        }
+        rules->frequencies.assign(frequencies, frequencies + nb_patterns);
+        rules->index_patterns();
+
+        // The lists are stored as the propagator holds them.
+        rules->propagator = std::make_shared<const Propagator::PropagatorState>(
+            std::span<const uint32_t>(offsets, nb_patterns * 4 + 1),
+            std::span<const uint16_t>(ids, header.nb_ids), std::move(storage));
+        return rules;
+    }
+
+public:
+    /**
+     * Write the rules extracted from input with options and kept to the file at
+     * path. Return false if the file couldn't be written.
+     */
+    static bool save(const FString& path, const Array2D<T>& input,
+        const OverlappingWFCOptions& options, const std::vector<Array2D<T>>& kept,
+        const OverlappingWFCRules<T, N>& rules) noexcept {
+        const unsigned nb_patterns = static_cast<unsigned>(rules.patterns.size());
+        const Propagator::PropagatorState& propagator = *rules.propagator;
+
+        Header header;
+        header.magic = MAGIC;
+        header.version = VERSION;
+        header.pixel_size = sizeof(T);
+        header.periodic_input = options.periodic_input;
+        header.symmetry = options.symmetry;
+        header.pattern_size = options.pattern_size;
+        header.prune_patterns = options.prune_patterns;
+        header.input_height = input.height;
+        header.input_width = input.width;
+        header.nb_kept = static_cast<uint32_t>(kept.size());
+        header.nb_patterns = nb_patterns;
+        header.nb_ids = static_cast<uint32_t>(propagator.get_nb_ids());
+        Layout layout(header);
+
+        TArray<uint8> bytes;
+        bytes.SetNumZeroed(layout.size);
+        uint8_t* data = bytes.GetData();
+        std::memcpy(data, &header, sizeof(Header));
+        std::memcpy(data + layout.input, input.data.data(), input.data.size() * sizeof(T));
+
+        T* kept_data = reinterpret_cast<T*>(data + layout.kept);
+        for (const Array2D<T>& pattern : kept) {
+            check(pattern.height == options.pattern_size && pattern.width == options.pattern_size);
+            kept_data = std::copy(pattern.data.begin(), pattern.data.end(), kept_data);
+        }
+
+        T* pattern_data = reinterpret_cast<T*>(data + layout.patterns);
+        for (const auto& pattern : rules.patterns) {
+            check(pattern.height == options.pattern_size && pattern.width == options.pattern_size);
+            pattern_data = std::copy(pattern.data.begin(), pattern.data.end(), pattern_data);
+        }
+        std::memcpy(data + layout.frequencies, rules.frequencies.data(),
+            nb_patterns * sizeof(double));
+
+        uint32_t* offsets = reinterpret_cast<uint32_t*>(data + layout.offsets);
+        uint16_t* ids = reinterpret_cast<uint16_t*>(data + layout.ids);
+        uint32_t nb_ids = 0;
+        for (unsigned pattern = 0; pattern < nb_patterns; pattern++) {
+            for (unsigned direction = 0; direction < 4; direction++) {
+                offsets[pattern * 4 + direction] = nb_ids;
+                for (unsigned other : propagator.get(pattern, direction)) {
+                    ids[nb_ids++] = other;
+                }
+            }
+        }
+        offsets[nb_patterns * 4] = nb_ids;
+
+        return FFileHelper::SaveArrayToFile(bytes, *path);
+    }
+
+    /**
+     * Map the file at path and return the rules it holds, or nullptr if it
+     * doesn't exist, can't be mapped, or wasn't compiled from input with
+     * options and kept (in which case the rules have to be extracted again).
+     * The file stays mapped until the rules are released.
+     */
+    static std::shared_ptr<const OverlappingWFCRules<T, N>> load(const FString& path,
+        const Array2D<T>& input, const OverlappingWFCOptions& options,
+        const std::vector<Array2D<T>>& kept) noexcept {
+        auto mapped = std::make_shared<MappedFile>();
+        mapped->handle.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*path));
+        if (!mapped->handle || mapped->handle->GetFileSize() <= 0) {
+            return nullptr;
+        }
+        mapped->region.Reset(mapped->handle->MapRegion(0, mapped->handle->GetFileSize()));
+        if (!mapped->region) {
+            return nullptr;
+        }
+        const uint8_t* data = mapped->region->GetMappedPtr();
+        const std::size_t size = mapped->region->GetMappedSize();
+        return read(data, size, input, options, kept, std::move(mapped));
+    }
+};
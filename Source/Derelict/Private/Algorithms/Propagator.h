@@ -4,10 +4,16 @@
 
 #include "CoreMinimal.h"
 #include "Containers/Array.h"
+#include "Async/ParallelFor.h"
 #include "Algorithms/Wave.h"
-#include "Algorithms/array3D.h"
 
 #include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <span>
+#include <unordered_map>
 #include <vector>
 
 constexpr int directions_x[4] = { 0, -1, 1, 0 };
@@ -17,95 +23,792 @@ constexpr unsigned get_opposite_direction(unsigned direction) noexcept {
 	return 3 - direction;
 }
 
+/**
+ * The algorithm used by the propagator to enforce arc consistency.
+ */
+enum class PropagatorEngine {
+    ac4,    // One support counter per (cell, pattern, direction), decremented on removal.
+    bitset  // Neighbour domains recomputed from bit-packed compatibility rows.
+};
+
 
 class Propagator {
 public:
-    using PropagatorState = std::vector<std::array<std::vector<unsigned>, 4>>;
+    /**
+     * The compatibility lists of the patterns, in one contiguous block. The
+     * list of (pattern, direction), the patterns that can be placed next to
+     * pattern in direction, is ids[offsets[pattern * 4 + direction]] to
+     * ids[offsets[pattern * 4 + direction + 1]]. It is built once per rules,
+     * and shared by every propagator using them. The block is either owned by
+     * the state or read in place from a storage it keeps alive, like a mapped
+     * rules file.
+     */
+    class PropagatorState {
+    private:
+        std::vector<uint32_t> owned_offsets;
+        std::vector<uint16_t> owned_ids;
+        std::shared_ptr<const void> storage;
+        std::span<const uint32_t> offsets;
+        std::span<const uint16_t> ids;
+
+    public:
+        /**
+         * The lists as built by the models, lists[pattern][direction].
+         */
+        using Lists = std::vector<std::array<std::vector<unsigned>, 4>>;
+
+        /**
+         * The largest number of patterns, so their ids fit in 16 bits.
+         */
+        static constexpr std::size_t MAX_PATTERNS = 1 << 16;
+
+        explicit PropagatorState(const Lists& lists) noexcept {
+            check(lists.size() <= MAX_PATTERNS);
+            owned_offsets.reserve(lists.size() * 4 + 1);
+            owned_offsets.push_back(0);
+            for (const auto& pattern_lists : lists) {
+                for (const auto& list : pattern_lists) {
+                    owned_ids.insert(owned_ids.end(), list.begin(), list.end());
+                    owned_offsets.push_back(static_cast<uint32_t>(owned_ids.size()));
+                }
+            }
+            offsets = owned_offsets;
+            ids = owned_ids;
+        }
+
+        /**
+         * Use a block held by storage as is, without copying it. offsets must
+         * have nb_patterns * 4 + 1 entries, and ids must be smaller than
+         * nb_patterns. storage is released with the state.
+         */
+        PropagatorState(std::span<const uint32_t> offsets, std::span<const uint16_t> ids,
+            std::shared_ptr<const void> storage) noexcept
+            : storage(std::move(storage)), offsets(offsets), ids(ids) {
+            check(offsets.size() % 4 == 1 && offsets.back() == ids.size());
+        }
+
+        /**
+         * The spans may point to the owned vectors, so the state isn't copied.
+         */
+        PropagatorState(const PropagatorState&) = delete;
+        PropagatorState& operator=(const PropagatorState&) = delete;
+
+        /**
+         * Return the number of patterns.
+         */
+        std::size_t size() const noexcept { return offsets.size() / 4; }
+
+        /**
+         * Return the number of ids of every list.
+         */
+        std::size_t get_nb_ids() const noexcept { return ids.size(); }
+
+        /**
+         * Return the patterns that can be placed next to pattern in direction,
+         * in increasing order.
+         */
+        std::span<const uint16_t> get(unsigned pattern, unsigned direction) const noexcept {
+            const uint32_t* range = &offsets[pattern * 4 + direction];
+            return { ids.data() + range[0], ids.data() + range[1] };
+        }
+    };
+
+    /**
+     * The counters of the AC-4 engine, see compatible_8. The bitset engine
+     * has no state between two propagations, so its snapshots are empty.
+     */
+    struct Snapshot {
+        std::array<std::vector<uint8_t>, 4> compatible_8;
+        std::array<std::vector<uint16_t>, 4> compatible_16;
+    };
 
 private:
 
+    /**
+     * The compatibility lists, shared between every propagator using the same
+     * rules. propagator_state.get(pattern, direction) contains the patterns
+     * that can be placed next to pattern in direction.
+     */
+    const std::shared_ptr<const PropagatorState> shared_state;
+    const PropagatorState& propagator_state;
     const std::size_t patterns_size;
-    PropagatorState propagator_state;
     const unsigned wave_width;
     const unsigned wave_height;
     const bool periodic_output;
-    std::vector<std::tuple<unsigned, unsigned, unsigned>> propagating;
-    Array3D<std::array<int, 4>> compatible;
+    const PropagatorEngine engine;
 
-    void init_compatible() noexcept {
-        std::array<int, 4> value;
+    /**
+     * The removals that have not been propagated yet, as (cell, pattern).
+     */
+    std::vector<std::pair<unsigned, unsigned>> propagating;
 
-        for (unsigned y = 0; y < wave_height; y++) {
-            for (unsigned x = 0; x < wave_width; x++) {
-                for (unsigned pattern = 0; pattern < patterns_size; pattern++) {
-                    for (int direction = 0; direction < 4; direction++) {
-                        value[direction] =
-                            static_cast<unsigned>(propagator_state[pattern][get_opposite_direction(direction)]
-                                .size());
+    /**
+     * neighbours[direction][cell] is the index of the neighbour of cell in
+     * direction, or -1 if it is outside of the wave, computed once so the
+     * propagation loops don't do any division or bounds check. With a
+     * periodic output there is no -1.
+     */
+    std::array<std::vector<int>, 4> neighbours;
+
+    /**
+     * AC-4 engine only.
+     * compatible_N[direction][cell * patterns_size + pattern] is the number of
+     * patterns of the neighbour in the opposite direction that are still
+     * compatible with pattern in cell. The counters of removed patterns keep
+     * being maintained, so every counter is exact and a removal is undone by
+     * incrementing back the counters it decremented. There is one plane per
+     * direction, so propagating a removal in a direction only touches that
+     * plane. The counters are 8 bits wide when every initial count fits, and
+     * 16 bits wide otherwise; only one of the two arrays is used.
+     */
+    bool small_counters;
+    std::array<std::vector<uint8_t>, 4> compatible_8;
+    std::array<std::vector<uint16_t>, 4> compatible_16;
+
+    /**
+     * AC-4 engine only, parallel propagation.
+     * The wave is split in bands of TILE_ROWS rows, and every band is
+     * propagated by its own task: it is the only one to change the counters
+     * and the patterns of its cells. A removal next to another band is sent
+     * to that band through outboxes[parity][band][side], side 0 being the band
+     * above and 1 the band below. Every band only writes its own outboxes, and
+     * reads its neighbours' ones in the next round, so no lock is needed.
+     * Arc consistency has a single fixed point, so this ends with the same
+     * wave and counters as the serial propagation. Bands and messages are
+     * handled in a fixed order, so the result doesn't depend on the threads.
+     */
+    static constexpr unsigned TILE_ROWS = 8;
+    static constexpr std::size_t PARALLEL_MIN_REMOVALS = 1024;
+    struct TileMessage {
+        unsigned cell;      // The cell whose counters are decremented.
+        unsigned direction; // The direction from the removed pattern to cell.
+        unsigned pattern;   // The removed pattern.
+    };
+    const bool parallel;
+    const unsigned nb_tiles;
+    std::vector<std::vector<std::pair<unsigned, unsigned>>> tile_propagating;
+    std::vector<std::vector<std::pair<unsigned, unsigned>>> tile_removed;
+    std::array<std::vector<std::array<std::vector<TileMessage>, 2>>, 2> outboxes;
+
+    /**
+     * Bitset engine only.
+     * Patterns with the same overlap in a direction have the same compatibility
+     * row, so rows are deduplicated per direction into classes. Class c of
+     * direction has its members bitset at
+     * class_members[direction][c * nb_words] and its compatible patterns at
+     * class_rows[direction][c * nb_words].
+     */
+    const unsigned nb_words;
+    std::array<unsigned, 4> nb_classes;
+    std::array<std::vector<uint64_t>, 4> class_members;
+    std::array<std::vector<uint64_t>, 4> class_rows;
+
+    /**
+     * Bitset engine only.
+     * The cells whose domain changed and that have not been propagated yet.
+     * queued[cell] is set while the cell is in propagating_cells.
+     */
+    std::vector<unsigned> propagating_cells;
+    std::vector<uint8_t> queued;
+
+    /**
+     * Fill every plane with the counters of the first cell, built once and
+     * replicated with memcpy.
+     */
+    template <typename Counter>
+    void init_compatible(std::array<std::vector<Counter>, 4>& compatible) noexcept {
+        const std::size_t plane_size = wave_width * wave_height * patterns_size;
+        for (unsigned direction = 0; direction < 4; direction++) {
+            std::vector<Counter>& plane = compatible[direction];
+            plane.resize(plane_size);
+            if (plane_size == 0) {
+                continue;
+            }
+            for (unsigned pattern = 0; pattern < patterns_size; pattern++) {
+                plane[pattern] = static_cast<Counter>(
+                    propagator_state.get(pattern, get_opposite_direction(direction)).size());
+            }
+            for (std::size_t filled = patterns_size; filled < plane_size;) {
+                std::size_t count = std::min(filled, plane_size - filled);
+                std::memcpy(plane.data() + filled, plane.data(), count * sizeof(Counter));
+                filled += count;
+            }
+        }
+    }
+
+    /**
+     * Hash and equality of a compatibility list, used to deduplicate the rows.
+     * The lists are compared in place, in the shared state.
+     */
+    struct RowHash {
+        std::size_t operator()(std::span<const uint16_t> row) const noexcept {
+            std::size_t seed = row.size();
+            for (unsigned i : row) {
+                seed ^= i + (std::size_t)0x9e3779b9 + (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+
+    struct RowEqual {
+        bool operator()(std::span<const uint16_t> a, std::span<const uint16_t> b) const noexcept {
+            return std::equal(a.begin(), a.end(), b.begin(), b.end());
+        }
+    };
+
+    void init_propagator_bits() noexcept {
+        for (unsigned direction = 0; direction < 4; direction++) {
+            std::unordered_map<std::span<const uint16_t>, unsigned, RowHash, RowEqual> classes;
+            class_members[direction].clear();
+            class_rows[direction].clear();
+            for (unsigned pattern = 0; pattern < patterns_size; pattern++) {
+                std::span<const uint16_t> row = propagator_state.get(pattern, direction);
+                auto res = classes.insert({ row, static_cast<unsigned>(classes.size()) });
+                unsigned c = res.first->second;
+                if (res.second) {
+                    class_members[direction].resize((c + 1) * nb_words, 0);
+                    class_rows[direction].resize((c + 1) * nb_words, 0);
+                    for (unsigned other : row) {
+                        class_rows[direction][c * nb_words + (other >> 6)] |=
+                            uint64_t(1) << (other & 63);
                     }
-                    compatible.get(y, x, pattern) = value;
                 }
+                class_members[direction][c * nb_words + (pattern >> 6)] |=
+                    uint64_t(1) << (pattern & 63);
             }
+            nb_classes[direction] = static_cast<unsigned>(classes.size());
         }
     }
 
-public:
+    /**
+     * Return the index of the neighbour of (y1, x1) in direction, or -1 if it
+     * is outside of the wave.
+     */
+    int get_neighbour(unsigned y1, unsigned x1, unsigned direction) const noexcept {
+        int dx = directions_x[direction];
+        int dy = directions_y[direction];
+        int x2, y2;
+        if (periodic_output) {
+            x2 = ((int)x1 + dx + (int)wave_width) % wave_width;
+            y2 = ((int)y1 + dy + (int)wave_height) % wave_height;
+        }
+        else {
+            x2 = x1 + dx;
+            y2 = y1 + dy;
+            if (x2 < 0 || x2 >= (int)wave_width) {
+                return -1;
+            }
+            if (y2 < 0 || y2 >= (int)wave_height) {
+                return -1;
+            }
+        }
+        return x2 + y2 * wave_width;
+    }
 
-    Propagator(unsigned wave_height, unsigned wave_width, bool periodic_output,
-        PropagatorState propagator_state) noexcept
-        : patterns_size(propagator_state.size()),
-        propagator_state(propagator_state), wave_width(wave_width),
-        wave_height(wave_height), periodic_output(periodic_output),
-        compatible(wave_height, wave_width, patterns_size) {
-        init_compatible();
+    void init_neighbours() noexcept {
+        for (unsigned direction = 0; direction < 4; direction++) {
+            neighbours[direction].resize(wave_width * wave_height);
+            for (unsigned y = 0; y < wave_height; y++) {
+                for (unsigned x = 0; x < wave_width; x++) {
+                    neighbours[direction][y * wave_width + x] = get_neighbour(y, x, direction);
+                }
+            }
+        }
     }
 
-    void add_to_propagator(unsigned y, unsigned x, unsigned pattern) noexcept {
-        std::array<int, 4> temp = {};
-        compatible.get(y, x, pattern) = temp;
-        propagating.emplace_back(y, x, pattern);
+    template <typename Counter>
+    void restore_compatible(std::array<std::vector<Counter>, 4>& compatible,
+        unsigned i1, unsigned pattern) noexcept {
+        for (unsigned direction = 0; direction < 4; direction++) {
+            int i2 = neighbours[direction][i1];
+            if (i2 < 0) {
+                continue;
+            }
+            Counter* counters = compatible[direction].data() + i2 * patterns_size;
+            for (unsigned other : propagator_state.get(pattern, direction)) {
+                counters[other]++;
+            }
+        }
     }
 
-    void propagate(Wave& wave) noexcept {
+    /**
+     * Recompute the counters of cell i2 from the patterns of its neighbours.
+     */
+    template <typename Counter>
+    void recompute_compatible(const Wave& wave, std::array<std::vector<Counter>, 4>& compatible,
+        unsigned i2) noexcept {
+        for (unsigned direction = 0; direction < 4; direction++) {
+            Counter* counters = compatible[direction].data() + i2 * patterns_size;
+            int i1 = neighbours[get_opposite_direction(direction)][i2];
+            if (i1 < 0) {
+                for (unsigned pattern = 0; pattern < patterns_size; pattern++) {
+                    counters[pattern] = static_cast<Counter>(
+                        propagator_state.get(pattern, get_opposite_direction(direction)).size());
+                }
+                continue;
+            }
+            std::fill(counters, counters + patterns_size, Counter(0));
+            wave.for_each_pattern(i1, [&](unsigned pattern) {
+                for (unsigned other : propagator_state.get(pattern, direction)) {
+                    counters[other]++;
+                }
+            });
+        }
+    }
+
+    template <typename Counter>
+    void reset_area_ac4(Wave& wave, std::array<std::vector<Counter>, 4>& compatible,
+        unsigned y0, unsigned x0, unsigned y1, unsigned x1) noexcept {
+        // The counters of the area and of the ring around it depend on the
+        // patterns added back.
+        for (unsigned y = y0; y < y1; y++) {
+            for (unsigned x = x0; x < x1; x++) {
+                unsigned i = y * wave_width + x;
+                recompute_compatible(wave, compatible, i);
+                for (unsigned direction = 0; direction < 4; direction++) {
+                    int i2 = neighbours[direction][i];
+                    if (i2 >= 0) {
+                        unsigned y2 = i2 / wave_width;
+                        unsigned x2 = i2 % wave_width;
+                        if (y2 < y0 || y2 >= y1 || x2 < x0 || x2 >= x1) {
+                            recompute_compatible(wave, compatible, i2);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Only the patterns of the area can have lost their support, the
+        // cells around it only gained some.
+        for (unsigned y = y0; y < y1; y++) {
+            for (unsigned x = x0; x < x1; x++) {
+                unsigned i = y * wave_width + x;
+                wave.for_each_pattern(i, [&](unsigned pattern) {
+                    for (unsigned direction = 0; direction < 4; direction++) {
+                        if (compatible[direction][i * patterns_size + pattern] == 0) {
+                            propagating.emplace_back(i, pattern);
+                            wave.set(i, pattern, false);
+                            return;
+                        }
+                    }
+                });
+            }
+        }
+    }
+
+    /**
+     * Propagate the pending removals with the AC-4 engine. With a periodic
+     * output every cell has 4 neighbours, so the check is compiled out.
+     */
+    template <bool periodic, typename Counter>
+    void propagate_ac4(Wave& wave, std::array<std::vector<Counter>, 4>& compatible) noexcept {
         while (propagating.size() != 0) {
-            unsigned y1, x1, pattern;
-            std::tie(y1, x1, pattern) = propagating.back();
+            auto [i1, pattern] = propagating.back();
             propagating.pop_back();
 
             for (unsigned direction = 0; direction < 4; direction++) {
-                int dx = directions_x[direction];
-                int dy = directions_y[direction];
-                int x2, y2;
-                if (periodic_output) {
-                    x2 = ((int)x1 + dx + (int)wave.width) % wave.width;
-                    y2 = ((int)y1 + dy + (int)wave.height) % wave.height;
-                }
-                else {
-                    x2 = x1 + dx;
-                    y2 = y1 + dy;
-                    if (x2 < 0 || x2 >= (int)wave.width) {
-                        continue;
-                    }
-                    if (y2 < 0 || y2 >= (int)wave.height) {
+                int i2 = neighbours[direction][i1];
+                if constexpr (!periodic) {
+                    if (i2 < 0) {
                         continue;
                     }
                 }
 
-                unsigned i2 = x2 + y2 * wave.width;
-                const std::vector<unsigned>& patterns =
-                    propagator_state[pattern][direction];
+                std::span<const uint16_t> patterns =
+                    propagator_state.get(pattern, direction);
+                Counter* counters = compatible[direction].data() + i2 * patterns_size;
 
                 for (auto it = patterns.begin(), it_end = patterns.end(); it < it_end;
                     ++it) {
 
-                    std::array<int, 4>& value = compatible.get(y2, x2, *it);
-                    value[direction]--;
-                    if (value[direction] == 0) {
-                        add_to_propagator(y2, x2, *it);
+                    // The counter of an already removed pattern can reach 0
+                    // too, so the wave is only checked then.
+                    Counter& value = counters[*it];
+                    value--;
+                    if (value == 0 && wave.get(i2, *it)) {
+                        propagating.emplace_back(i2, *it);
                         wave.set(i2, *it, false);
                     }
                 }
             }
         }
     }
+
+    /**
+     * Decrement the counters of cell i2 supported by pattern in direction,
+     * removing the patterns left without support. The cell must belong to
+     * tile.
+     */
+    template <typename Counter>
+    void decrement_tile(Wave& wave, std::array<std::vector<Counter>, 4>& compatible,
+        unsigned tile, unsigned i2, unsigned direction, unsigned pattern) noexcept {
+        Counter* counters = compatible[direction].data() + i2 * patterns_size;
+        for (unsigned other : propagator_state.get(pattern, direction)) {
+            Counter& value = counters[other];
+            value--;
+            if (value == 0 && wave.get(i2, other)) {
+                tile_propagating[tile].emplace_back(i2, other);
+                tile_removed[tile].emplace_back(i2, other);
+                wave.remove_unsynchronized(i2, other);
+            }
+        }
+    }
+
+    /**
+     * One round of the parallel propagation for tile: handle the messages
+     * sent by the neighbour bands in the previous round, then propagate inside
+     * the band until nothing is left, sending the removals next to the other
+     * bands.
+     */
+    template <typename Counter>
+    void propagate_tile(Wave& wave, std::array<std::vector<Counter>, 4>& compatible,
+        unsigned tile, unsigned parity) noexcept {
+        const bool has_above = periodic_output || tile > 0;
+        const bool has_below = periodic_output || tile + 1 < nb_tiles;
+        const unsigned above = (tile + nb_tiles - 1) % nb_tiles;
+        const unsigned below = (tile + 1) % nb_tiles;
+        if (has_above) {
+            for (const TileMessage& message : outboxes[parity][above][1]) {
+                decrement_tile(wave, compatible, tile, message.cell, message.direction,
+                    message.pattern);
+            }
+        }
+        if (has_below) {
+            for (const TileMessage& message : outboxes[parity][below][0]) {
+                decrement_tile(wave, compatible, tile, message.cell, message.direction,
+                    message.pattern);
+            }
+        }
+
+        auto& sent = outboxes[parity ^ 1][tile];
+        sent[0].clear();
+        sent[1].clear();
+        const unsigned tile_begin = tile * TILE_ROWS * wave_width;
+        const unsigned tile_end = std::min(tile_begin + TILE_ROWS * wave_width,
+            wave_width * wave_height);
+        auto& stack = tile_propagating[tile];
+        while (stack.size() != 0) {
+            auto [i1, pattern] = stack.back();
+            stack.pop_back();
+
+            for (unsigned direction = 0; direction < 4; direction++) {
+                int i2 = neighbours[direction][i1];
+                if (i2 < 0) {
+                    continue;
+                }
+                if ((unsigned)i2 >= tile_begin && (unsigned)i2 < tile_end) {
+                    decrement_tile(wave, compatible, tile, i2, direction, pattern);
+                }
+                else {
+                    sent[directions_y[direction] < 0 ? 0 : 1].push_back(
+                        { static_cast<unsigned>(i2), direction, pattern });
+                }
+            }
+        }
+    }
+
+    /**
+     * Propagate the pending removals with one task per band, in rounds, until
+     * no message is left. The wave memoisation is updated at the end, in band
+     * order.
+     */
+    template <typename Counter>
+    void propagate_parallel(Wave& wave, std::array<std::vector<Counter>, 4>& compatible) noexcept {
+        for (const auto& [i, pattern] : propagating) {
+            tile_propagating[i / (TILE_ROWS * wave_width)].emplace_back(i, pattern);
+        }
+        propagating.clear();
+
+        unsigned parity = 0;
+        bool pending = true;
+        while (pending) {
+            ParallelFor(nb_tiles, [&](int32 tile) {
+                propagate_tile(wave, compatible, static_cast<unsigned>(tile), parity);
+            });
+            parity ^= 1;
+            pending = false;
+            for (const auto& sent : outboxes[parity]) {
+                pending = pending || !sent[0].empty() || !sent[1].empty();
+            }
+        }
+        // The messages of the last round were handled, the next propagation
+        // starts with empty outboxes.
+        for (auto& sent : outboxes[parity ^ 1]) {
+            sent[0].clear();
+            sent[1].clear();
+        }
+
+        for (auto& removed : tile_removed) {
+            for (const auto& [index, pattern] : removed) {
+                wave.commit_removal(index, pattern);
+            }
+            removed.clear();
+        }
+    }
+
+    /**
+     * For every changed cell, the supports it offers in each direction are the
+     * OR of the compatibility rows of its remaining patterns, and the neighbour
+     * domain is ANDed with that union. The word loops are plain enough for the
+     * compiler to vectorize.
+     */
+    void propagate_bitset(Wave& wave) noexcept {
+        std::vector<uint64_t> support(nb_words);
+        while (propagating_cells.size() != 0) {
+            unsigned i1 = propagating_cells.back();
+            propagating_cells.pop_back();
+            queued[i1] = 0;
+            const uint64_t* domain1 = wave.get_words(i1);
+
+            for (unsigned direction = 0; direction < 4; direction++) {
+                int i2 = neighbours[direction][i1];
+                if (i2 < 0) {
+                    continue;
+                }
+                const uint64_t* domain2 = wave.get_words(i2);
+
+                // Union of the rows of the classes present in the cell, stopping
+                // as soon as it covers the whole neighbour domain.
+                std::fill(support.begin(), support.end(), 0);
+                bool covered = false;
+                const uint64_t* members = class_members[direction].data();
+                const uint64_t* rows = class_rows[direction].data();
+                for (unsigned c = 0; c < nb_classes[direction] && !covered; c++) {
+                    uint64_t present = 0;
+                    for (unsigned w = 0; w < nb_words; w++) {
+                        present |= domain1[w] & members[c * nb_words + w];
+                    }
+                    if (present == 0) {
+                        continue;
+                    }
+                    uint64_t missing = 0;
+                    for (unsigned w = 0; w < nb_words; w++) {
+                        support[w] |= rows[c * nb_words + w];
+                        missing |= domain2[w] & ~support[w];
+                    }
+                    covered = missing == 0;
+                }
+
+                if (!covered && wave.intersect(i2, support.data()) && !queued[i2]) {
+                    queued[i2] = 1;
+                    propagating_cells.push_back(i2);
+                }
+            }
+        }
+    }
+
+public:
+
+    Propagator(unsigned wave_height, unsigned wave_width, bool periodic_output,
+        std::shared_ptr<const PropagatorState> state,
+        PropagatorEngine engine = PropagatorEngine::ac4, bool parallel = false) noexcept
+        : shared_state(std::move(state)),
+        propagator_state(*shared_state), patterns_size(shared_state->size()),
+        wave_width(wave_width),
+        wave_height(wave_height), periodic_output(periodic_output),
+        engine(engine), small_counters(true),
+        parallel(parallel && engine == PropagatorEngine::ac4 && wave_height > TILE_ROWS),
+        nb_tiles((wave_height + TILE_ROWS - 1) / TILE_ROWS),
+        nb_words(static_cast<unsigned>((patterns_size + 63) / 64)) {
+        init_neighbours();
+        if (engine == PropagatorEngine::ac4) {
+            std::size_t max_count = 0;
+            for (unsigned pattern = 0; pattern < patterns_size; pattern++) {
+                for (unsigned direction = 0; direction < 4; direction++) {
+                    max_count = std::max(max_count,
+                        propagator_state.get(pattern, direction).size());
+                }
+            }
+            check(max_count <= std::numeric_limits<uint16_t>::max());
+            small_counters = max_count <= std::numeric_limits<uint8_t>::max();
+            if (small_counters) {
+                init_compatible(compatible_8);
+            }
+            else {
+                init_compatible(compatible_16);
+            }
+            if (this->parallel) {
+                tile_propagating.resize(nb_tiles);
+                tile_removed.resize(nb_tiles);
+                outboxes[0].resize(nb_tiles);
+                outboxes[1].resize(nb_tiles);
+            }
+        }
+        else {
+            init_propagator_bits();
+            queued.assign(wave_width * wave_height, 0);
+        }
+    }
+
+    /**
+     * Return, for every pattern of state, 1 if it can be placed in a cell with
+     * a neighbour in every direction, and 0 otherwise. This is arc consistency
+     * over the rules alone: a pattern is dead when, in some direction, every
+     * pattern that could be placed next to it is dead, starting from the
+     * patterns with an empty compatibility list. The kept patterns, such as
+     * the ones set on the edges of the output, are never dead, and keep
+     * supporting their neighbours.
+     */
+    static std::vector<uint8_t> get_live_patterns(const PropagatorState& state,
+        const std::vector<unsigned>& kept = {}) noexcept {
+        const std::size_t nb_patterns = state.size();
+        std::vector<uint8_t> live(nb_patterns, 1);
+        std::vector<uint8_t> is_kept(nb_patterns, 0);
+        for (unsigned pattern : kept) {
+            is_kept[pattern] = 1;
+        }
+        std::vector<std::array<std::size_t, 4>> supports(nb_patterns);
+        std::vector<unsigned> dead;
+        for (unsigned pattern = 0; pattern < nb_patterns; pattern++) {
+            for (unsigned direction = 0; direction < 4; direction++) {
+                supports[pattern][direction] = state.get(pattern, direction).size();
+                if (supports[pattern][direction] == 0 && live[pattern] && !is_kept[pattern]) {
+                    live[pattern] = 0;
+                    dead.push_back(pattern);
+                }
+            }
+        }
+
+        // A dead pattern stops supporting the patterns it could be placed
+        // next to.
+        while (!dead.empty()) {
+            unsigned pattern = dead.back();
+            dead.pop_back();
+            for (unsigned direction = 0; direction < 4; direction++) {
+                for (unsigned other : state.get(pattern, direction)) {
+                    std::size_t& count = supports[other][get_opposite_direction(direction)];
+                    count--;
+                    if (count == 0 && live[other] && !is_kept[other]) {
+                        live[other] = 0;
+                        dead.push_back(other);
+                    }
+                }
+            }
+        }
+        return live;
+    }
+
+    /**
+     * Record that pattern was removed from cell (y, x). The removal is
+     * propagated to the neighbours on the next call to propagate.
+     */
+    void add_to_propagator(unsigned y, unsigned x, unsigned pattern) noexcept {
+        if (engine == PropagatorEngine::bitset) {
+            unsigned i = y * wave_width + x;
+            if (!queued[i]) {
+                queued[i] = 1;
+                propagating_cells.push_back(i);
+            }
+            return;
+        }
+        propagating.emplace_back(y * wave_width + x, pattern);
+    }
+
+    /**
+     * Undo the propagation of the removal of pattern from cell index, once the
+     * pattern was added back to the wave. Used with Wave::undo_trail to go
+     * back to an earlier state, after propagate has finished.
+     */
+    void restore(unsigned index, unsigned pattern) noexcept {
+        if (engine == PropagatorEngine::bitset) {
+            return;
+        }
+        if (small_counters) {
+            restore_compatible(compatible_8, index, pattern);
+        }
+        else {
+            restore_compatible(compatible_16, index, pattern);
+        }
+    }
+
+    /**
+     * Make the propagator consistent again after patterns were added back to
+     * the cells of [y0, y1) x [x0, x1) with Wave::add_patterns: the counters of
+     * these cells and of their neighbours are recomputed from the wave, and
+     * the patterns of the area left without support are removed. Call
+     * propagate afterwards.
+     */
+    void reset_area(Wave& wave, unsigned y0, unsigned x0, unsigned y1, unsigned x1) noexcept {
+        if (engine == PropagatorEngine::bitset) {
+            // The cells of the area are filtered by the supports of their
+            // neighbours, and filter them in turn.
+            for (unsigned y = y0; y < y1; y++) {
+                for (unsigned x = x0; x < x1; x++) {
+                    unsigned i = y * wave_width + x;
+                    for (unsigned direction = 0; direction < 4; direction++) {
+                        int i2 = neighbours[direction][i];
+                        if (i2 >= 0 && !queued[i2]) {
+                            queued[i2] = 1;
+                            propagating_cells.push_back(i2);
+                        }
+                    }
+                }
+            }
+            return;
+        }
+        if (small_counters) {
+            reset_area_ac4(wave, compatible_8, y0, x0, y1, x1);
+        }
+        else {
+            reset_area_ac4(wave, compatible_16, y0, x0, y1, x1);
+        }
+    }
+
+    /**
+     * Return the counters, once every removal was propagated.
+     */
+    Snapshot snapshot() const noexcept {
+        check(propagating.empty() && propagating_cells.empty());
+        return { compatible_8, compatible_16 };
+    }
+
+    /**
+     * Replace the counters with the ones of a snapshot of a propagator of the
+     * same wave size, rules and engine, taken with the wave restored along.
+     */
+    void restore_snapshot(const Snapshot& snapshot) noexcept {
+        check(snapshot.compatible_8[0].size() == compatible_8[0].size() &&
+            snapshot.compatible_16[0].size() == compatible_16[0].size());
+        clear();
+        compatible_8 = snapshot.compatible_8;
+        compatible_16 = snapshot.compatible_16;
+    }
+
+    /**
+     * Drop the removals that haven't been propagated yet.
+     */
+    void clear() noexcept {
+        propagating.clear();
+        for (unsigned i : propagating_cells) {
+            queued[i] = 0;
+        }
+        propagating_cells.clear();
+    }
+
+    /**
+     * Propagate the pending removals. With the parallel propagation, large
+     * batches of removals, like the ones of the constraints set before a run,
+     * are propagated on the worker threads.
+     */
+    void propagate(Wave& wave) noexcept {
+        if (engine == PropagatorEngine::bitset) {
+            propagate_bitset(wave);
+        }
+        else if (parallel && propagating.size() >= PARALLEL_MIN_REMOVALS) {
+            if (small_counters) {
+                propagate_parallel(wave, compatible_8);
+            }
+            else {
+                propagate_parallel(wave, compatible_16);
+            }
+        }
+        else if (small_counters) {
+            periodic_output ? propagate_ac4<true>(wave, compatible_8)
+                : propagate_ac4<false>(wave, compatible_8);
+        }
+        else {
+            periodic_output ? propagate_ac4<true>(wave, compatible_16)
+                : propagate_ac4<false>(wave, compatible_16);
+        }
+    }
 };
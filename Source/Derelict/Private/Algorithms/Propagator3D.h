@@ -0,0 +1,422 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Algorithms/Propagator.h"
+#include "Algorithms/Wave.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * The 6 directions of a volume: below, up, left, right, down and above, where
+ * below and above change the deck. The opposite of a direction is 5 minus it,
+ * and directions 1 to 4 are the directions of the 2D wave in the same order.
+ */
+constexpr int directions_3d_x[6] = { 0, 0, -1, 1, 0, 0 };
+constexpr int directions_3d_y[6] = { 0, -1, 0, 0, 1, 0 };
+constexpr int directions_3d_z[6] = { -1, 0, 0, 0, 0, 1 };
+
+constexpr unsigned get_opposite_direction_3d(unsigned direction) noexcept {
+    return 5 - direction;
+}
+
+/**
+ * Propagator of a volume wave, made of decks of height * width cells. Cell
+ * (z, y, x) has index (z * height + y) * width + x, so the cells of a row are
+ * contiguous, then the rows of a deck.
+ * The AC-4 engine keeps 6 counters per (cell, pattern), which is a lot of
+ * memory on large volumes with many patterns; the bitset engine only uses the
+ * wave and its cost doesn't depend on the counters fitting in cache.
+ */
+class Propagator3D {
+public:
+    using PropagatorState = std::vector<std::array<std::vector<unsigned>, 6>>;
+
+private:
+
+    /**
+     * The compatibility lists, shared between every propagator using the same
+     * rules. propagator_state[pattern][direction] contains the patterns that
+     * can be placed next to pattern in direction.
+     */
+    const std::shared_ptr<const PropagatorState> shared_state;
+    const PropagatorState& propagator_state;
+    const std::size_t patterns_size;
+    const unsigned wave_width;
+    const unsigned wave_height;
+    const unsigned wave_depth;
+    const unsigned wave_size;
+    const bool periodic_output;
+    const PropagatorEngine engine;
+
+    /**
+     * The neighbour of cell in direction is cell + offsets[direction], unless
+     * bit direction of border[cell] is set. It is then outside of the wave,
+     * or cell + wrap_offsets[direction] with a periodic output. A volume has
+     * too many cells for a table of neighbours to stay in cache, so only one
+     * byte per cell is stored.
+     */
+    std::array<int, 6> offsets;
+    std::array<int, 6> wrap_offsets;
+    std::vector<uint8_t> border;
+
+    /**
+     * The removals that have not been propagated yet, as (cell, pattern).
+     */
+    std::vector<std::pair<unsigned, unsigned>> propagating;
+
+    /**
+     * AC-4 engine only.
+     * compatible_N[direction][cell * patterns_size + pattern] is the number of
+     * patterns of the neighbour in the opposite direction that are still
+     * compatible with pattern in cell, as in Propagator. There is one plane
+     * per direction, so propagating a removal in a direction only touches that
+     * plane.
+     */
+    bool small_counters;
+    std::array<std::vector<uint8_t>, 6> compatible_8;
+    std::array<std::vector<uint16_t>, 6> compatible_16;
+
+    /**
+     * Bitset engine only, as in Propagator: the compatibility rows are
+     * deduplicated per direction into classes, and the changed cells are
+     * queued once. pattern_class[direction][pattern] is the class of pattern,
+     * used when a cell has fewer patterns left than there are classes.
+     */
+    const unsigned nb_words;
+    std::array<unsigned, 6> nb_classes;
+    std::array<std::vector<unsigned>, 6> pattern_class;
+    std::array<std::vector<uint64_t>, 6> class_members;
+    std::array<std::vector<uint64_t>, 6> class_rows;
+    std::vector<unsigned> propagating_cells;
+    std::vector<uint8_t> queued;
+
+    /**
+     * Return the index of the neighbour of cell in direction, or -1 if it is
+     * outside of the wave.
+     */
+    int get_neighbour(unsigned cell, unsigned direction) const noexcept {
+        if (border[cell] & (1u << direction)) {
+            return periodic_output ? (int)cell + wrap_offsets[direction] : -1;
+        }
+        return (int)cell + offsets[direction];
+    }
+
+    void init_neighbours() noexcept {
+        const int deck = (int)(wave_width * wave_height);
+        offsets = { -deck, -(int)wave_width, -1, 1, (int)wave_width, deck };
+        wrap_offsets = { deck * (int)(wave_depth - 1), (int)(wave_width * (wave_height - 1)),
+            (int)wave_width - 1, 1 - (int)wave_width, -(int)(wave_width * (wave_height - 1)),
+            -deck * (int)(wave_depth - 1) };
+
+        border.resize(wave_size);
+        for (unsigned z = 0; z < wave_depth; z++) {
+            for (unsigned y = 0; y < wave_height; y++) {
+                for (unsigned x = 0; x < wave_width; x++) {
+                    border[(z * wave_height + y) * wave_width + x] = static_cast<uint8_t>(
+                        (z == 0) << 0 | (y == 0) << 1 | (x == 0) << 2 |
+                        (x == wave_width - 1) << 3 | (y == wave_height - 1) << 4 |
+                        (z == wave_depth - 1) << 5);
+                }
+            }
+        }
+    }
+
+    /**
+     * Fill every plane with the counters of the first cell, built once and
+     * replicated with memcpy.
+     */
+    template <typename Counter>
+    void init_compatible(std::array<std::vector<Counter>, 6>& compatible) noexcept {
+        const std::size_t plane_size = wave_size * patterns_size;
+        for (unsigned direction = 0; direction < 6; direction++) {
+            std::vector<Counter>& plane = compatible[direction];
+            plane.resize(plane_size);
+            if (plane_size == 0) {
+                continue;
+            }
+            for (unsigned pattern = 0; pattern < patterns_size; pattern++) {
+                plane[pattern] = static_cast<Counter>(
+                    propagator_state[pattern][get_opposite_direction_3d(direction)].size());
+            }
+            for (std::size_t filled = patterns_size; filled < plane_size;) {
+                std::size_t count = std::min(filled, plane_size - filled);
+                std::memcpy(plane.data() + filled, plane.data(), count * sizeof(Counter));
+                filled += count;
+            }
+        }
+    }
+
+    /**
+     * Hash of a compatibility list, used to deduplicate the rows.
+     */
+    struct RowHash {
+        std::size_t operator()(const std::vector<unsigned>& row) const noexcept {
+            std::size_t seed = row.size();
+            for (unsigned i : row) {
+                seed ^= i + (std::size_t)0x9e3779b9 + (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+
+    void init_propagator_bits() noexcept {
+        for (unsigned direction = 0; direction < 6; direction++) {
+            std::unordered_map<std::vector<unsigned>, unsigned, RowHash> classes;
+            for (unsigned pattern = 0; pattern < patterns_size; pattern++) {
+                const std::vector<unsigned>& row = propagator_state[pattern][direction];
+                auto res = classes.insert({ row, static_cast<unsigned>(classes.size()) });
+                unsigned c = res.first->second;
+                pattern_class[direction].push_back(c);
+                if (res.second) {
+                    class_members[direction].resize((c + 1) * nb_words, 0);
+                    class_rows[direction].resize((c + 1) * nb_words, 0);
+                    for (unsigned other : row) {
+                        class_rows[direction][c * nb_words + (other >> 6)] |=
+                            uint64_t(1) << (other & 63);
+                    }
+                }
+                class_members[direction][c * nb_words + (pattern >> 6)] |=
+                    uint64_t(1) << (pattern & 63);
+            }
+            nb_classes[direction] = static_cast<unsigned>(classes.size());
+        }
+    }
+
+    template <typename Counter>
+    void restore_compatible(std::array<std::vector<Counter>, 6>& compatible,
+        unsigned i1, unsigned pattern) noexcept {
+        for (unsigned direction = 0; direction < 6; direction++) {
+            int i2 = get_neighbour(i1, direction);
+            if (i2 < 0) {
+                continue;
+            }
+            Counter* counters = compatible[direction].data() + i2 * patterns_size;
+            for (unsigned other : propagator_state[pattern][direction]) {
+                counters[other]++;
+            }
+        }
+    }
+
+    /**
+     * Propagate the pending removals with the AC-4 engine.
+     */
+    template <typename Counter>
+    void propagate_ac4(Wave& wave, std::array<std::vector<Counter>, 6>& compatible) noexcept {
+        while (propagating.size() != 0) {
+            auto [i1, pattern] = propagating.back();
+            propagating.pop_back();
+
+            for (unsigned direction = 0; direction < 6; direction++) {
+                int i2 = get_neighbour(i1, direction);
+                if (i2 < 0) {
+                    continue;
+                }
+
+                Counter* counters = compatible[direction].data() + i2 * patterns_size;
+                for (unsigned other : propagator_state[pattern][direction]) {
+                    // The counter of an already removed pattern can reach 0
+                    // too, so the wave is only checked then.
+                    Counter& value = counters[other];
+                    value--;
+                    if (value == 0 && wave.get(i2, other)) {
+                        propagating.emplace_back(i2, other);
+                        wave.set(i2, other, false);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Propagate the changed cells with the bitset engine, as in Propagator.
+     */
+    void propagate_bitset(Wave& wave) noexcept {
+        std::vector<uint64_t> support(nb_words);
+        while (propagating_cells.size() != 0) {
+            unsigned i1 = propagating_cells.back();
+            propagating_cells.pop_back();
+            queued[i1] = 0;
+            const uint64_t* domain1 = wave.get_words(i1);
+
+            for (unsigned direction = 0; direction < 6; direction++) {
+                int i2 = get_neighbour(i1, direction);
+                if (i2 < 0) {
+                    continue;
+                }
+                const uint64_t* domain2 = wave.get_words(i2);
+
+                std::fill(support.begin(), support.end(), 0);
+                bool covered = false;
+                const uint64_t* members = class_members[direction].data();
+                const uint64_t* rows = class_rows[direction].data();
+                if (wave.get_nb_patterns(i1) < nb_classes[direction]) {
+                    // Most cells are decided or nearly, so their few patterns
+                    // are walked instead of every class.
+                    wave.for_each_pattern(i1, [&](unsigned pattern) {
+                        const uint64_t* row = rows + pattern_class[direction][pattern] * nb_words;
+                        for (unsigned w = 0; w < nb_words; w++) {
+                            support[w] |= row[w];
+                        }
+                    });
+                    uint64_t missing = 0;
+                    for (unsigned w = 0; w < nb_words; w++) {
+                        missing |= domain2[w] & ~support[w];
+                    }
+                    covered = missing == 0;
+                }
+                else {
+                    for (unsigned c = 0; c < nb_classes[direction] && !covered; c++) {
+                        uint64_t present = 0;
+                        for (unsigned w = 0; w < nb_words; w++) {
+                            present |= domain1[w] & members[c * nb_words + w];
+                        }
+                        if (present == 0) {
+                            continue;
+                        }
+                        uint64_t missing = 0;
+                        for (unsigned w = 0; w < nb_words; w++) {
+                            support[w] |= rows[c * nb_words + w];
+                            missing |= domain2[w] & ~support[w];
+                        }
+                        covered = missing == 0;
+                    }
+                }
+
+                if (!covered && wave.intersect(i2, support.data()) && !queued[i2]) {
+                    queued[i2] = 1;
+                    propagating_cells.push_back(i2);
+                }
+            }
+        }
+    }
+
+public:
+
+    Propagator3D(unsigned wave_depth, unsigned wave_height, unsigned wave_width,
+        bool periodic_output, std::shared_ptr<const PropagatorState> state,
+        PropagatorEngine engine = PropagatorEngine::ac4) noexcept
+        : shared_state(std::move(state)),
+        propagator_state(*shared_state), patterns_size(shared_state->size()),
+        wave_width(wave_width), wave_height(wave_height), wave_depth(wave_depth),
+        wave_size(wave_width * wave_height * wave_depth),
+        periodic_output(periodic_output), engine(engine), small_counters(true),
+        nb_words(static_cast<unsigned>((patterns_size + 63) / 64)) {
+        init_neighbours();
+        if (engine == PropagatorEngine::ac4) {
+            std::size_t max_count = 0;
+            for (const auto& lists : propagator_state) {
+                for (const auto& list : lists) {
+                    max_count = std::max(max_count, list.size());
+                }
+            }
+            check(max_count <= std::numeric_limits<uint16_t>::max());
+            small_counters = max_count <= std::numeric_limits<uint8_t>::max();
+            if (small_counters) {
+                init_compatible(compatible_8);
+            }
+            else {
+                init_compatible(compatible_16);
+            }
+        }
+        else {
+            init_propagator_bits();
+            queued.assign(wave_size, 0);
+        }
+    }
+
+    /**
+     * Record that pattern was removed from cell index. The removal is
+     * propagated to the neighbours on the next call to propagate.
+     */
+    void add_to_propagator(unsigned index, unsigned pattern) noexcept {
+        if (engine == PropagatorEngine::bitset) {
+            if (!queued[index]) {
+                queued[index] = 1;
+                propagating_cells.push_back(index);
+            }
+            return;
+        }
+        propagating.emplace_back(index, pattern);
+    }
+
+    /**
+     * Undo the propagation of the removal of pattern from cell index, once the
+     * pattern was added back to the wave. See Propagator::restore.
+     */
+    void restore(unsigned index, unsigned pattern) noexcept {
+        if (engine == PropagatorEngine::bitset) {
+            return;
+        }
+        if (small_counters) {
+            restore_compatible(compatible_8, index, pattern);
+        }
+        else {
+            restore_compatible(compatible_16, index, pattern);
+        }
+    }
+
+    /**
+     * Remove from every cell of wave the patterns that have no compatible
+     * pattern in a direction where the cell has a neighbour. Their counters
+     * start at 0, so the AC-4 engine would never remove them. The removals
+     * are propagated on the next call to propagate.
+     */
+    void remove_unsupported(Wave& wave) noexcept {
+        for (unsigned direction = 0; direction < 6; direction++) {
+            std::vector<unsigned> unsupported;
+            for (unsigned pattern = 0; pattern < patterns_size; pattern++) {
+                if (propagator_state[pattern][direction].empty()) {
+                    unsupported.push_back(pattern);
+                }
+            }
+            if (unsupported.empty()) {
+                continue;
+            }
+            for (unsigned i = 0; i < wave_size; i++) {
+                if (get_neighbour(i, direction) < 0) {
+                    continue;
+                }
+                for (unsigned pattern : unsupported) {
+                    if (wave.get(i, pattern)) {
+                        wave.set(i, pattern, false);
+                        add_to_propagator(i, pattern);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Drop the removals that haven't been propagated yet.
+     */
+    void clear() noexcept {
+        propagating.clear();
+        for (unsigned i : propagating_cells) {
+            queued[i] = 0;
+        }
+        propagating_cells.clear();
+    }
+
+    /**
+     * Propagate the pending removals.
+     */
+    void propagate(Wave& wave) noexcept {
+        if (engine == PropagatorEngine::bitset) {
+            propagate_bitset(wave);
+        }
+        else if (small_counters) {
+            propagate_ac4(wave, compatible_8);
+        }
+        else {
+            propagate_ac4(wave, compatible_16);
+        }
+    }
+};
@@ -0,0 +1,541 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include <array>
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "Algorithms/array2D.h"
+#include "Algorithms/WFC.h"
+
+/**
+ * The symmetry of a tile, named after the letter with the same symmetries.
+ * The symmetry axis of T and I is vertical, and the one of L and backslash
+ * goes from the bottom left corner to the top right corner (so an L tile
+ * connects its left and bottom sides).
+ */
+enum class Symmetry { X, T, I, L, backslash, P };
+
+/**
+ * Return the number of distinct orientations of a tile with symmetry.
+ */
+constexpr unsigned nb_of_possible_orientations(const Symmetry& symmetry) {
+    switch (symmetry) {
+    case Symmetry::X:
+        return 1;
+    case Symmetry::I:
+    case Symmetry::backslash:
+        return 2;
+    case Symmetry::T:
+    case Symmetry::L:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+/**
+ * Return the symmetry named by the letter c (X, T, I, L, \ or P), or nullopt.
+ */
+template <typename C> constexpr std::optional<Symmetry> to_symmetry(C c) noexcept {
+    switch (c) {
+    case 'X':
+        return Symmetry::X;
+    case 'T':
+        return Symmetry::T;
+    case 'I':
+        return Symmetry::I;
+    case 'L':
+        return Symmetry::L;
+    case '\\':
+        return Symmetry::backslash;
+    case 'P':
+        return Symmetry::P;
+    default:
+        return std::nullopt;
+    }
+}
+
+/**
+ * A tile that can be placed on the board.
+ */
+template <typename T> struct Tile {
+    std::vector<Array2D<T>> data; // The different orientations of the tile.
+    Symmetry symmetry;            // The symmetry of the tile.
+    double weight; // Its weight on the distribution of presence of tiles.
+
+    /**
+     * Generate the map associating an orientation id to the orientation
+     * id obtained when rotating 90° anticlockwise the tile.
+     */
+    static std::vector<unsigned> generate_rotation_map(const Symmetry& symmetry) noexcept {
+        switch (symmetry) {
+        case Symmetry::X:
+            return { 0 };
+        case Symmetry::I:
+        case Symmetry::backslash:
+            return { 1, 0 };
+        case Symmetry::T:
+        case Symmetry::L:
+            return { 1, 2, 3, 0 };
+        case Symmetry::P:
+        default:
+            return { 1, 2, 3, 0, 5, 6, 7, 4 };
+        }
+    }
+
+    /**
+     * Generate the map associating an orientation id to the orientation
+     * id obtained when reflecting the tile along the x axis.
+     */
+    static std::vector<unsigned> generate_reflection_map(const Symmetry& symmetry) noexcept {
+        switch (symmetry) {
+        case Symmetry::X:
+            return { 0 };
+        case Symmetry::I:
+            return { 0, 1 };
+        case Symmetry::backslash:
+            return { 1, 0 };
+        case Symmetry::T:
+            return { 0, 3, 2, 1 };
+        case Symmetry::L:
+            return { 1, 0, 3, 2 };
+        case Symmetry::P:
+        default:
+            return { 4, 7, 6, 5, 0, 3, 2, 1 };
+        }
+    }
+
+    /**
+     * Generate the map associating an orientation id and an action to the
+     * resulting orientation id.
+     * Actions 0, 1, 2, and 3 are 0°, 90°, 180°, and 270° anticlockwise
+     * rotations. Actions 4, 5, 6, and 7 are actions 0, 1, 2, and 3 preceded by
+     * a reflection on the x axis.
+     */
+    static std::vector<std::vector<unsigned>> generate_action_map(const Symmetry& symmetry) noexcept {
+        std::vector<unsigned> rotation_map = generate_rotation_map(symmetry);
+        std::vector<unsigned> reflection_map = generate_reflection_map(symmetry);
+        std::size_t size = rotation_map.size();
+        std::vector<std::vector<unsigned>> action_map(8, std::vector<unsigned>(size));
+        for (std::size_t i = 0; i < size; ++i) {
+            action_map[0][i] = static_cast<unsigned>(i);
+        }
+        for (std::size_t a = 1; a < 4; ++a) {
+            for (std::size_t i = 0; i < size; ++i) {
+                action_map[a][i] = rotation_map[action_map[a - 1][i]];
+            }
+        }
+        for (std::size_t i = 0; i < size; ++i) {
+            action_map[4][i] = reflection_map[action_map[0][i]];
+        }
+        for (std::size_t a = 5; a < 8; ++a) {
+            for (std::size_t i = 0; i < size; ++i) {
+                action_map[a][i] = rotation_map[action_map[a - 1][i]];
+            }
+        }
+        return action_map;
+    }
+
+    /**
+     * Generate all distinct rotations of a 2D array given its symmetries.
+     */
+    static std::vector<Array2D<T>> generate_oriented(Array2D<T> data, Symmetry symmetry) noexcept {
+        std::vector<Array2D<T>> oriented;
+        oriented.push_back(data);
+
+        switch (symmetry) {
+        case Symmetry::I:
+        case Symmetry::backslash:
+            oriented.push_back(data.rotated());
+            break;
+        case Symmetry::T:
+        case Symmetry::L:
+            oriented.push_back(data = data.rotated());
+            oriented.push_back(data = data.rotated());
+            oriented.push_back(data = data.rotated());
+            break;
+        case Symmetry::P:
+            oriented.push_back(data = data.rotated());
+            oriented.push_back(data = data.rotated());
+            oriented.push_back(data = data.rotated());
+            oriented.push_back(data = data.rotated().reflected());
+            oriented.push_back(data = data.rotated());
+            oriented.push_back(data = data.rotated());
+            oriented.push_back(data = data.rotated());
+            break;
+        default:
+            break;
+        }
+
+        return oriented;
+    }
+
+    /**
+     * Create a tile with its different orientations, its symmetries and its
+     * weight on the distribution of tiles.
+     */
+    Tile(std::vector<Array2D<T>> data, Symmetry symmetry, double weight) noexcept
+        : data(std::move(data)), symmetry(symmetry), weight(weight) {}
+
+    /**
+     * Create a tile with its base orientation, its symmetries and its
+     * weight on the distribution of tiles.
+     * The other orientations are generated with its first one.
+     */
+    Tile(Array2D<T> data, Symmetry symmetry, double weight) noexcept
+        : data(generate_oriented(std::move(data), symmetry)), symmetry(symmetry),
+        weight(weight) {}
+};
+
+/**
+ * A neighbour rule (tile1, orientation1, tile2, orientation2): tile1 in
+ * orientation1 can be placed on the left of tile2 in orientation2. The rules
+ * obtained by rotating and reflecting the pair are implied.
+ */
+using TileNeighbour = std::tuple<unsigned, unsigned, unsigned, unsigned>;
+
+/**
+ * Options needed to use the tiling wfc.
+ */
+struct TilingWFCOptions {
+    bool periodic_output; // True if the output is toric.
+    unsigned out_height;  // The height of the output in pixels, a multiple of the tile size.
+    unsigned out_width;   // The width of the output in pixels, a multiple of the tile size.
+    WFCSolverOptions solver; // The options of the generic WFC algorithm.
+};
+
+/**
+ * The tiles in every orientation, their weights and which oriented tiles can
+ * be placed next to each other. Built once from the tiles and the neighbour
+ * rules, and shared between every TilingWFC using them.
+ */
+template <typename T> struct TilingWFCRules {
+    /**
+     * The distincts tiles, and their size in pixels.
+     */
+    std::vector<Tile<T>> tiles;
+    unsigned tile_size;
+
+    /**
+     * Map ids of oriented tiles to tile and orientation, and the reverse.
+     */
+    std::vector<std::pair<unsigned, unsigned>> id_to_oriented_tile;
+    std::vector<std::vector<unsigned>> oriented_tile_ids;
+
+    /**
+     * The id of the first oriented tile with some pixels.
+     */
+    std::unordered_map<Array2D<T>, unsigned> pixels_to_oriented_tile;
+
+    /**
+     * The weight of every oriented tile, and the compatibility lists.
+     */
+    std::vector<double> frequencies;
+    std::shared_ptr<const Propagator::PropagatorState> propagator;
+
+    /**
+     * Build the rules of tiles with the neighbour rules neighbours. Every
+     * orientation of every tile must have the same size.
+     */
+    static std::shared_ptr<const TilingWFCRules> make(std::vector<Tile<T>> tiles,
+        const std::vector<TileNeighbour>& neighbours) noexcept {
+        auto rules = std::make_shared<TilingWFCRules>();
+        check(!tiles.empty());
+        rules->tile_size = tiles[0].data[0].height;
+        rules->tiles = std::move(tiles);
+
+        for (unsigned i = 0; i < rules->tiles.size(); i++) {
+            const Tile<T>& tile = rules->tiles[i];
+            std::vector<unsigned> ids;
+            for (unsigned j = 0; j < tile.data.size(); j++) {
+                check(tile.data[j].height == rules->tile_size && tile.data[j].width == rules->tile_size);
+                ids.push_back(static_cast<unsigned>(rules->id_to_oriented_tile.size()));
+                rules->pixels_to_oriented_tile.emplace(tile.data[j], ids.back());
+                rules->id_to_oriented_tile.push_back({ i, j });
+                rules->frequencies.push_back(tile.weight / tile.data.size());
+            }
+            rules->oriented_tile_ids.push_back(std::move(ids));
+        }
+
+        rules->propagator = generate_propagator(neighbours, *rules);
+        return rules;
+    }
+
+private:
+    /**
+     * Generate the compatibility lists from the neighbour rules, adding every
+     * rotation and reflection of each rule.
+     */
+    static std::shared_ptr<const Propagator::PropagatorState> generate_propagator(
+        const std::vector<TileNeighbour>& neighbours, const TilingWFCRules& rules) noexcept {
+        const std::size_t nb_oriented_tiles = rules.id_to_oriented_tile.size();
+        std::vector<std::array<std::vector<bool>, 4>> dense_propagator(nb_oriented_tiles, {
+            std::vector<bool>(nb_oriented_tiles, false),
+            std::vector<bool>(nb_oriented_tiles, false),
+            std::vector<bool>(nb_oriented_tiles, false),
+            std::vector<bool>(nb_oriented_tiles, false) });
+
+        for (const auto& [tile1, orientation1, tile2, orientation2] : neighbours) {
+            check(tile1 < rules.tiles.size() && tile2 < rules.tiles.size());
+            check(orientation1 < rules.tiles[tile1].data.size());
+            check(orientation2 < rules.tiles[tile2].data.size());
+            std::vector<std::vector<unsigned>> action_map1 =
+                Tile<T>::generate_action_map(rules.tiles[tile1].symmetry);
+            std::vector<std::vector<unsigned>> action_map2 =
+                Tile<T>::generate_action_map(rules.tiles[tile2].symmetry);
+
+            auto add = [&](unsigned action, unsigned direction) {
+                unsigned oriented_tile_id1 =
+                    rules.oriented_tile_ids[tile1][action_map1[action][orientation1]];
+                unsigned oriented_tile_id2 =
+                    rules.oriented_tile_ids[tile2][action_map2[action][orientation2]];
+                dense_propagator[oriented_tile_id1][direction][oriented_tile_id2] = true;
+                dense_propagator[oriented_tile_id2][get_opposite_direction(direction)]
+                    [oriented_tile_id1] = true;
+            };
+
+            add(0, 2);
+            add(1, 0);
+            add(2, 1);
+            add(3, 3);
+            add(4, 1);
+            add(5, 3);
+            add(6, 2);
+            add(7, 0);
+        }
+
+        Propagator::PropagatorState::Lists lists(nb_oriented_tiles);
+        for (std::size_t i = 0; i < nb_oriented_tiles; ++i) {
+            for (unsigned direction = 0; direction < 4; ++direction) {
+                for (unsigned j = 0; j < nb_oriented_tiles; ++j) {
+                    if (dense_propagator[i][direction][j]) {
+                        lists[i][direction].push_back(j);
+                    }
+                }
+            }
+        }
+        return std::make_shared<const Propagator::PropagatorState>(lists);
+    }
+};
+
+/**
+ * Class generating a new image with the tiling WFC algorithm: the output is
+ * made of hand-declared tiles placed side by side, following explicit
+ * neighbour rules. There are much fewer tiles than patterns extracted by the
+ * overlapping model, so it solves faster.
+ */
+template <typename T> class TilingWFC {
+public:
+    using Rules = TilingWFCRules<T>;
+
+private:
+    /**
+     * The tiles, their weights and their compatibility lists.
+     */
+    std::shared_ptr<const Rules> rules;
+
+    /**
+     * The options of the output.
+     */
+    TilingWFCOptions options;
+
+    /**
+     * The size of the wave, in tiles.
+     */
+    unsigned height;
+    unsigned width;
+
+    /**
+     * The underlying generic WFC algorithm.
+     */
+    WFC wfc;
+
+    /**
+     * Translate the generic WFC result into the image result.
+     */
+    Array2D<T> id_to_tiling(const Array2D<unsigned>& ids) const noexcept {
+        const unsigned size = rules->tile_size;
+        Array2D<T> tiling(size * ids.height, size * ids.width);
+        for (unsigned i = 0; i < ids.height; i++) {
+            for (unsigned j = 0; j < ids.width; j++) {
+                auto [tile, orientation] = rules->id_to_oriented_tile[ids.get(i, j)];
+                const Array2D<T>& data = rules->tiles[tile].data[orientation];
+                for (unsigned y = 0; y < size; y++) {
+                    for (unsigned x = 0; x < size; x++) {
+                        tiling.get(i * size + y, j * size + x) = data.get(y, x);
+                    }
+                }
+            }
+        }
+        return tiling;
+    }
+
+    /**
+     * Set the oriented tile at cell (i, j), by removing every other tile.
+     */
+    void set_oriented_tile(unsigned oriented_tile_id, unsigned i, unsigned j) noexcept {
+        WFCConstraints constraints = make_constraints();
+        constraints.add(i, j, oriented_tile_id);
+        wfc.constrain(i, j, constraints.get_mask(0));
+    }
+
+public:
+    /**
+     * Construct the TilingWFC class to generate a tiled image.
+     */
+    TilingWFC(std::shared_ptr<const Rules> rules, const TilingWFCOptions& options,
+        int seed) noexcept
+        : rules(std::move(rules)), options(options),
+        height(options.out_height / this->rules->tile_size),
+        width(options.out_width / this->rules->tile_size),
+        wfc(options.periodic_output, seed, this->rules->frequencies,
+            this->rules->propagator, height, width, options.solver) {}
+
+    /**
+     * Set the tile tile_id in orientation at cell (i, j) of the wave.
+     * Returns false if the tile, the orientation or the cell doesn't exist.
+     */
+    bool set_tile(unsigned tile_id, unsigned orientation, unsigned i, unsigned j) noexcept {
+        if (tile_id >= rules->oriented_tile_ids.size() ||
+            orientation >= rules->oriented_tile_ids[tile_id].size() ||
+            i >= height || j >= width) {
+            return false;
+        }
+        set_oriented_tile(rules->oriented_tile_ids[tile_id][orientation], i, j);
+        return true;
+    }
+
+    /**
+     * Set the oriented tile whose pixels are pattern at pixel (i, j), which
+     * must be on the tile grid. Returns false if no oriented tile has these
+     * pixels, or if the position isn't a tile of the output. Together with
+     * get_options, this gives the same interface as OverlappingWFC.
+     */
+    bool set_pattern(const Array2D<T>& pattern, unsigned i, unsigned j) noexcept {
+        const unsigned size = rules->tile_size;
+        std::optional<unsigned> oriented_tile_id = get_pattern_id(pattern);
+        if (!oriented_tile_id.has_value() ||
+            i % size != 0 || j % size != 0 || i / size >= height || j / size >= width) {
+            return false;
+        }
+        set_oriented_tile(*oriented_tile_id, i / size, j / size);
+        return true;
+    }
+
+    /**
+     * Return the id of the oriented tile whose pixels are pattern.
+     */
+    std::optional<unsigned> get_pattern_id(const Array2D<T>& pattern) const noexcept {
+        auto it = rules->pixels_to_oriented_tile.find(pattern);
+        if (it == rules->pixels_to_oriented_tile.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    /**
+     * Return an empty batch of constraints for this wave.
+     */
+    WFCConstraints make_constraints() const noexcept {
+        return WFCConstraints(rules->id_to_oriented_tile.size());
+    }
+
+    /**
+     * Add to constraints the oriented tile oriented_tile_id at pixel (i, j),
+     * as in set_pattern. Returns false if the position isn't a tile of the
+     * output.
+     */
+    bool add_constraint(WFCConstraints& constraints, unsigned oriented_tile_id,
+        unsigned i, unsigned j) const noexcept {
+        const unsigned size = rules->tile_size;
+        if (i % size != 0 || j % size != 0 || i / size >= height || j / size >= width) {
+            return false;
+        }
+        constraints.add(i / size, j / size, oriented_tile_id);
+        return true;
+    }
+
+    /**
+     * Apply every constraint at once and propagate them.
+     * Returns false if the wave is then in contradiction.
+     */
+    bool apply_constraints(const WFCConstraints& constraints) noexcept {
+        return wfc.apply_constraints(constraints);
+    }
+
+    /**
+     * Return the state of the wave once the constraints are applied, to skip
+     * them in the waves of other seeds with the same options (see WFCSnapshot).
+     */
+    WFCSnapshot snapshot() const noexcept {
+        return wfc.snapshot();
+    }
+
+    /**
+     * Replace the state of the wave with a snapshot taken with the same rules
+     * and options, before the run.
+     */
+    void restore_snapshot(const WFCSnapshot& snapshot) noexcept {
+        wfc.restore_snapshot(snapshot);
+    }
+
+    /**
+     * Require the tiles at pixels (i, j), which must be on the tile grid, to
+     * stay connected during the run, through the tiles whose centre pixel p
+     * has walkable(p). Returns false if a position isn't a tile of the output.
+     * With an abort_interval, the run is aborted instead when they can't be
+     * connected anymore (see WFCConnectivity).
+     */
+    template <typename F>
+    bool set_connectivity(F&& walkable,
+        const std::vector<std::pair<unsigned, unsigned>>& cells,
+        unsigned abort_interval = 0) noexcept {
+        const unsigned size = rules->tile_size;
+        WFCConnectivity connectivity;
+        connectivity.abort_interval = abort_interval;
+        connectivity.walkable.assign((rules->id_to_oriented_tile.size() + 63) / 64, 0);
+        for (unsigned p = 0; p < rules->id_to_oriented_tile.size(); p++) {
+            auto [tile, orientation] = rules->id_to_oriented_tile[p];
+            if (walkable(rules->tiles[tile].data[orientation].get(size / 2, size / 2))) {
+                connectivity.walkable[p >> 6] |= uint64_t(1) << (p & 63);
+            }
+        }
+        for (auto [i, j] : cells) {
+            if (i % size != 0 || j % size != 0 || i / size >= height || j / size >= width) {
+                return false;
+            }
+            connectivity.required.push_back(i / size * width + j / size);
+        }
+        wfc.set_connectivity(std::move(connectivity));
+        return true;
+    }
+
+    /**
+     * Run the tiling wfc and return the result if the algorithm succeeded
+     */
+    std::optional<Array2D<T>> run() noexcept {
+        std::optional<Array2D<unsigned>> result = wfc.run();
+        if (result.has_value()) {
+            return id_to_tiling(*result);
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Return the counters of the last run.
+     */
+    const WFCStats& get_stats() const noexcept {
+        return wfc.get_stats();
+    }
+
+    const TilingWFCOptions& get_options() const {
+        return options;
+    }
+};
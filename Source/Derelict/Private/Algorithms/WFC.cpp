@@ -1,6 +1,7 @@
 // Fill out your copyright notice in the Description page of Project Settings.
 
 #include "Algorithms/WFC.h"
+#include <algorithm>
 #include <limits>
 
 namespace {
@@ -26,33 +27,274 @@ namespace {
 Array2D<unsigned> WFC::wave_to_output() const noexcept {
     Array2D<unsigned> output_patterns(wave.height, wave.width);
     for (unsigned i = 0; i < wave.size; i++) {
-        for (unsigned k = 0; k < nb_patterns; k++) {
-            if (wave.get(i, k)) {
-                output_patterns.data[i] = k;
-            }
-        }
+        output_patterns.data[i] = wave.get_first_pattern(i);
     }
     return output_patterns;
 }
 
 WFC::WFC(bool periodic_output, int seed,
     std::vector<double> patterns_frequencies,
-    Propagator::PropagatorState propagator, unsigned wave_height,
-    unsigned wave_width)
+    std::shared_ptr<const Propagator::PropagatorState> propagator,
+    unsigned wave_height, unsigned wave_width,
+    const WFCSolverOptions& solver_options)
     noexcept
     : gen(seed), patterns_frequencies(normalize(patterns_frequencies)),
-    wave(wave_height, wave_width, patterns_frequencies),
-    nb_patterns(propagator.size()),
-    propagator(wave.height, wave.width, periodic_output, propagator) {}
+    wave(wave_height, wave_width, patterns_frequencies, gen),
+    nb_patterns(propagator->size()),
+    propagator(wave.height, wave.width, periodic_output, std::move(propagator),
+        solver_options.propagator_engine, solver_options.parallel_propagation),
+    solver_options(solver_options), scanline_cursor(0), last_cell(-1),
+    last_pattern(0), last_cell_position(0), repair_radius(0), repair_y0(0), repair_x0(0),
+    repair_y1(0), repair_x1(0), periodic_output(periodic_output) {}
+
+void WFC::constrain(unsigned i, unsigned j, const uint64_t* mask) noexcept {
+    unsigned index = i * wave.width + j;
+    const uint64_t* words = wave.get_words(index);
+    for (unsigned w = 0; w < wave.get_nb_words(); w++) {
+        uint64_t removed = words[w] & ~mask[w];
+        while (removed != 0) {
+            propagator.add_to_propagator(i, j,
+                (w << 6) + static_cast<unsigned>(std::countr_zero(removed)));
+            removed &= removed - 1;
+        }
+    }
+    wave.intersect(index, mask);
+}
+
+bool WFC::apply_constraints(const WFCConstraints& constraints) noexcept {
+    check(constraints.nb_words == wave.get_nb_words());
+    for (std::size_t n = 0; n < constraints.size(); n++) {
+        auto [i, j] = constraints.cells[n];
+        check(i < wave.height && j < wave.width);
+        constrain(i, j, constraints.get_mask(n));
+    }
+    propagate_all();
+    return !wave.is_contradiction();
+}
+
+void WFC::set_connectivity(WFCConnectivity constraint) noexcept {
+    check(constraint.walkable.size() == wave.get_nb_words());
+    for (unsigned cell : constraint.required) {
+        check(cell < wave.size);
+    }
+    connectivity = std::move(constraint);
+    wave.set_walkable(connectivity.required.empty() ? std::vector<uint64_t>() : connectivity.walkable);
+    walkable_cells.clear();
+}
+
+void WFC::propagate_all() noexcept {
+    do {
+        propagator.propagate(wave);
+    } while (enforce_connectivity());
+}
+
+bool WFC::update_walkable_cells() noexcept {
+    if (walkable_cells.size() != wave.size) {
+        walkable_cells.resize(wave.size);
+        for (unsigned cell = 0; cell < wave.size; cell++) {
+            walkable_cells[cell] = wave.can_walk(cell);
+        }
+        wave.clear_walkable_flips();
+        return true;
+    }
+
+    // Only the cells that flipped since the last update are looked at. The
+    // searched cells are the ones reached from the first required cell, so
+    // the search only changes if one of them isn't walkable anymore, or if a
+    // new walkable cell is next to one of them.
+    bool moved = false;
+    for (unsigned cell : wave.get_walkable_flips()) {
+        const uint8_t walkable = wave.can_walk(cell);
+        if (walkable == walkable_cells[cell]) {
+            continue;
+        }
+        walkable_cells[cell] = walkable;
+        if (moved) {
+            continue;
+        }
+        moved = cut_order[cell] >= 0;
+        for (unsigned direction = 0; walkable && !moved && direction < 4; direction++) {
+            int neighbour = get_neighbour(cell, direction);
+            moved = neighbour >= 0 && cut_order[neighbour] >= 0;
+        }
+    }
+    wave.clear_walkable_flips();
+    return moved;
+}
+
+int WFC::get_neighbour(unsigned cell, unsigned direction) const noexcept {
+    int y = static_cast<int>(cell / wave.width) + directions_y[direction];
+    int x = static_cast<int>(cell % wave.width) + directions_x[direction];
+    if (periodic_output) {
+        y = (y + wave.height) % wave.height;
+        x = (x + wave.width) % wave.width;
+    }
+    else if (y < 0 || y >= static_cast<int>(wave.height) ||
+        x < 0 || x >= static_cast<int>(wave.width)) {
+        return -1;
+    }
+    return y * wave.width + x;
+}
+
+bool WFC::enforce_connectivity() noexcept {
+    if (connectivity.required.empty() || connectivity.abort_interval > 0 ||
+        wave.is_contradiction()) {
+        return false;
+    }
+    const uint64_t* walkable = connectivity.walkable.data();
+
+    // Restrict cell to its walkable patterns, returning true if some were
+    // removed.
+    auto restrict_cell = [&](unsigned cell) {
+        const uint64_t* words = wave.get_words(cell);
+        for (unsigned w = 0; w < wave.get_nb_words(); w++) {
+            if (words[w] & ~walkable[w]) {
+                constrain(cell / wave.width, cell % wave.width, walkable);
+                return true;
+            }
+        }
+        return false;
+    };
+
+    bool changed = false;
+    for (unsigned cell : connectivity.required) {
+        changed = restrict_cell(cell) || changed;
+    }
+
+    // The search only needs to run again when the walkable cells changed.
+    if (!update_walkable_cells()) {
+        return changed;
+    }
+
+    // Depth first search of the walkable cells from the first required cell,
+    // as in Tarjan's algorithm. A cell is a cut between required cells when
+    // one of its children can't reach above it without going through it,
+    // while the subtree of that child holds a required cell.
+    cut_order.assign(wave.size, -1);
+    cut_low.resize(wave.size);
+    cut_required.assign(wave.size, 0);
+    for (unsigned cell : connectivity.required) {
+        cut_required[cell] = 1;
+    }
+    const unsigned root = connectivity.required[0];
+    int order = 0;
+    cut_order[root] = cut_low[root] = order++;
+    cut_stack.assign(1, { root, 0 });
+    while (!cut_stack.empty()) {
+        const unsigned cell = cut_stack.back().first;
+        if (cut_stack.back().second < 4) {
+            int next = get_neighbour(cell, cut_stack.back().second++);
+            if (next < 0 || !walkable_cells[next]) {
+                continue;
+            }
+            if (cut_order[next] < 0) {
+                cut_order[next] = cut_low[next] = order++;
+                cut_stack.push_back({ static_cast<unsigned>(next), 0 });
+            }
+            else {
+                cut_low[cell] = std::min(cut_low[cell], cut_order[next]);
+            }
+            continue;
+        }
+
+        cut_stack.pop_back();
+        if (cut_stack.empty()) {
+            break;
+        }
+        const unsigned parent = cut_stack.back().first;
+        cut_low[parent] = std::min(cut_low[parent], cut_low[cell]);
+        cut_required[parent] += cut_required[cell];
+        if (parent != root && cut_low[cell] >= cut_order[parent] && cut_required[cell] > 0) {
+            changed = restrict_cell(parent) || changed;
+        }
+    }
+
+    // A required cell that can't be reached can't have any pattern.
+    for (unsigned cell : connectivity.required) {
+        if (cut_order[cell] < 0) {
+            std::vector<uint64_t> none(wave.get_nb_words(), 0);
+            constrain(cell / wave.width, cell % wave.width, none.data());
+            return true;
+        }
+    }
+    return changed;
+}
+
+bool WFC::is_doomed() noexcept {
+    if (connectivity.required.empty() || connectivity.abort_interval == 0 ||
+        wave.is_contradiction()) {
+        return false;
+    }
+
+    // An exit that can only be blank is the most common way to fail, and
+    // costs nothing to check.
+    for (unsigned cell : connectivity.required) {
+        if (!wave.can_walk(cell)) {
+            return true;
+        }
+    }
+    if (stats.nb_observations % connectivity.abort_interval != 0 ||
+        !update_walkable_cells()) {
+        return false;
+    }
+
+    // Breadth first search of the walkable cells from the first required
+    // cell, reusing the stack of the cut search as a queue.
+    cut_order.assign(wave.size, -1);
+    const unsigned root = connectivity.required[0];
+    cut_order[root] = 0;
+    cut_stack.assign(1, { root, 0 });
+    for (std::size_t next = 0; next < cut_stack.size(); next++) {
+        const unsigned cell = cut_stack[next].first;
+        for (unsigned direction = 0; direction < 4; direction++) {
+            int neighbour = get_neighbour(cell, direction);
+            if (neighbour >= 0 && walkable_cells[neighbour] && cut_order[neighbour] < 0) {
+                cut_order[neighbour] = 0;
+                cut_stack.push_back({ static_cast<unsigned>(neighbour), 0 });
+            }
+        }
+    }
+    for (unsigned cell : connectivity.required) {
+        if (cut_order[cell] < 0) {
+            return true;
+        }
+    }
+    return false;
+}
 
 std::optional<Array2D<unsigned>> WFC::run() noexcept {
+    // The constraints set before the run are propagated first. They are never
+    // undone, only the decisions taken from now on are recorded.
+    propagate_all();
+    if (is_doomed()) {
+        stats.nb_aborts++;
+        return std::nullopt;
+    }
+    bool backtracking = solver_options.backtrack_budget > 0;
+    if (solver_options.repair_budget > 0 && !wave.is_contradiction()) {
+        initial_domains.assign(wave.get_words(0),
+            wave.get_words(0) + wave.size * wave.get_nb_words());
+    }
+    wave.set_trail_enabled(backtracking || !initial_domains.empty());
+
     while (true) {
 
+        if (solver_options.cancel &&
+            solver_options.cancel->load(std::memory_order_relaxed)) {
+            return std::nullopt;
+        }
+
         // Define the value of an undefined cell.
         ObserveStatus result = observe();
 
         // Check if the algorithm has terminated.
         if (result == failure) {
+            if (backtracking && backtrack()) {
+                continue;
+            }
+            if (repair()) {
+                continue;
+            }
             return std::nullopt;
         }
         else if (result == success) {
@@ -60,17 +302,70 @@ std::optional<Array2D<unsigned>> WFC::run() noexcept {
         }
 
         // Propagate the information.
-        propagator.propagate(wave);
+        propagate_all();
+        if (is_doomed()) {
+            stats.nb_aborts++;
+            return std::nullopt;
+        }
+    }
+}
+
+
+int WFC::select_cell() noexcept {
+    switch (solver_options.observation) {
+    case ObservationStrategy::scanline:
+        if (wave.is_contradiction()) {
+            return -2;
+        }
+        while (scanline_cursor < wave.size && wave.get_nb_patterns(scanline_cursor) == 1) {
+            scanline_cursor++;
+        }
+        return scanline_cursor < wave.size ? static_cast<int>(scanline_cursor) : -1;
+
+    case ObservationStrategy::frontier:
+        // The cells around the last decision were just changed by its
+        // propagation, and are likely still in cache.
+        if (last_cell >= 0 && !wave.is_contradiction()) {
+            int y0 = last_cell / wave.width;
+            int x0 = last_cell % wave.width;
+            int best = -1;
+            double best_entropy = 0;
+            for (int y = std::max(y0 - FRONTIER_RADIUS, 0);
+                y <= std::min(y0 + FRONTIER_RADIUS, (int)wave.height - 1); y++) {
+                for (int x = std::max(x0 - FRONTIER_RADIUS, 0);
+                    x <= std::min(x0 + FRONTIER_RADIUS, (int)wave.width - 1); x++) {
+                    unsigned index = y * wave.width + x;
+                    if (wave.get_nb_patterns(index) <= 1) {
+                        continue;
+                    }
+                    double entropy = wave.get_noisy_entropy(index);
+                    if (best < 0 || entropy < best_entropy) {
+                        best = static_cast<int>(index);
+                        best_entropy = entropy;
+                    }
+                }
+            }
+            if (best >= 0) {
+                return best;
+            }
+        }
+        // Nothing left to decide around it, start again from the lowest
+        // entropy of the wave.
+        return wave.get_min_entropy();
+
+    default:
+        return wave.get_min_entropy();
     }
 }
 
 
 WFC::ObserveStatus WFC::observe() noexcept {
-    // Get the cell with lowest entropy.
-    int argmin = wave.get_min_entropy(gen);
+    // Get the next cell to decide.
+    int argmin = select_cell();
 
     // If there is a contradiction, the algorithm has failed.
     if (argmin == -2) {
+        stats.nb_contradictions++;
         return failure;
     }
 
@@ -83,30 +378,157 @@ WFC::ObserveStatus WFC::observe() noexcept {
 
     // Choose an element according to the pattern distribution
     double s = 0;
-    for (unsigned k = 0; k < nb_patterns; k++) {
-        s += wave.get(argmin, k) ? patterns_frequencies[k] : 0;
-    }
+    wave.for_each_pattern(argmin, [&](unsigned k) {
+        s += patterns_frequencies[k];
+    });
 
     std::uniform_real_distribution<> dis(0, s);
     double random_value = dis(gen);
-    size_t chosen_value = nb_patterns - 1;
+    size_t chosen_value = nb_patterns;
 
-    for (unsigned k = 0; k < nb_patterns; k++) {
-        random_value -= wave.get(argmin, k) ? patterns_frequencies[k] : 0;
+    wave.for_each_pattern(argmin, [&](unsigned k) {
+        if (chosen_value != nb_patterns) {
+            return;
+        }
+        random_value -= patterns_frequencies[k];
         if (random_value <= 0) {
             chosen_value = k;
-            break;
         }
+    });
+
+    // Rounding can leave random_value slightly positive, in which case the last
+    // possible pattern is chosen.
+    if (chosen_value == nb_patterns) {
+        wave.for_each_pattern(argmin, [&](unsigned k) { chosen_value = k; });
+    }
+
+    // Remember the decision so it can be undone, keeping only the most recent
+    // ones. Repairs only need the last one.
+    last_cell = argmin;
+    last_pattern = static_cast<unsigned>(chosen_value);
+    last_cell_position = wave.get_trail_position();
+    if (solver_options.backtrack_budget > 0) {
+        decisions.push_back({ static_cast<unsigned>(argmin),
+            static_cast<unsigned>(chosen_value), wave.get_trail_position() });
+        if (decisions.size() > solver_options.max_trail_depth) {
+            decisions.pop_front();
+            wave.drop_trail_before(decisions.front().wave_position);
+        }
+    }
+    else if (!initial_domains.empty()) {
+        wave.drop_trail_before(last_cell_position);
     }
 
     // And define the cell with the pattern.
-    for (unsigned k = 0; k < nb_patterns; k++) {
-        if (wave.get(argmin, k) != (k == chosen_value)) {
+    stats.nb_observations++;
+    wave.for_each_pattern(argmin, [&](unsigned k) {
+        if (k != chosen_value) {
             propagator.add_to_propagator(argmin / wave.width, argmin % wave.width,
                 k);
             wave.set(argmin, k, false);
         }
-    }
+    });
 
     return to_continue;
-}
\ No newline at end of file
+}
+
+bool WFC::backtrack() noexcept {
+    while (!decisions.empty() && stats.nb_backtracks < solver_options.backtrack_budget) {
+        Decision decision = decisions.back();
+        decisions.pop_back();
+        stats.nb_backtracks++;
+
+        // Go back to the state just before the decision. The propagation was
+        // complete, so adding back the removed patterns and their supports is
+        // enough.
+        propagator.clear();
+        wave.undo_trail(decision.wave_position, [&](unsigned index, unsigned pattern) {
+            propagator.restore(index, pattern);
+        });
+
+        // The chosen pattern leads to a contradiction, so it is banned. The
+        // ban is recorded as part of the previous decision.
+        remove_wave_pattern(decision.cell / wave.width,
+            decision.cell % wave.width, decision.pattern);
+        walkable_cells.clear();
+        propagate_all();
+
+        // Every cell before the decision was decided when it was taken.
+        scanline_cursor = std::min(scanline_cursor, decision.cell);
+        last_cell = static_cast<int>(decision.cell);
+        last_pattern = decision.pattern;
+        last_cell_position = decision.wave_position;
+
+        if (!wave.is_contradiction()) {
+            return true;
+        }
+        stats.nb_contradictions++;
+    }
+    return false;
+}
+
+bool WFC::repair() noexcept {
+    if (initial_domains.empty() || last_cell < 0 ||
+        stats.nb_repairs >= solver_options.repair_budget) {
+        return false;
+    }
+
+    // The propagation of a contradiction can empty a large part of the wave,
+    // so the wave first goes back to before the decision that led to it. The
+    // decisions can't be undone after the repair, so the trail is cleared.
+    propagator.clear();
+    wave.undo_trail(last_cell_position, [&](unsigned index, unsigned pattern) {
+        propagator.restore(index, pattern);
+    });
+    decisions.clear();
+    wave.set_trail_enabled(false);
+    wave.set_trail_enabled(true);
+    const std::size_t position = wave.get_trail_position();
+
+    const unsigned y = last_cell / wave.width;
+    const unsigned x = last_cell % wave.width;
+    bool repeated = y >= repair_y0 && y < repair_y1 && x >= repair_x0 && x < repair_x1;
+    repair_radius = repeated ? repair_radius * 2 : REPAIR_RADIUS;
+
+    const unsigned nb_words = wave.get_nb_words();
+    while (stats.nb_repairs < solver_options.repair_budget) {
+        stats.nb_repairs++;
+        repair_y0 = y - std::min(y, repair_radius);
+        repair_x0 = x - std::min(x, repair_radius);
+        repair_y1 = std::min(y + repair_radius + 1, wave.height);
+        repair_x1 = std::min(x + repair_radius + 1, wave.width);
+
+        for (unsigned i = repair_y0; i < repair_y1; i++) {
+            for (unsigned j = repair_x0; j < repair_x1; j++) {
+                unsigned index = i * wave.width + j;
+                wave.add_patterns(index, initial_domains.data() + index * nb_words);
+            }
+        }
+        propagator.reset_area(wave, repair_y0, repair_x0, repair_y1, repair_x1);
+
+        // The pattern of the decision led to the contradiction, so it is
+        // banned again from the reset cell.
+        remove_wave_pattern(y, x, last_pattern);
+        walkable_cells.clear();
+        propagate_all();
+
+        if (!wave.is_contradiction()) {
+            scanline_cursor = std::min(scanline_cursor, repair_y0 * wave.width + repair_x0);
+            return true;
+        }
+        stats.nb_contradictions++;
+        if (repair_y0 == 0 && repair_x0 == 0 &&
+            repair_y1 == wave.height && repair_x1 == wave.width) {
+            break;
+        }
+
+        // The area was too small. The removals of this try are undone, the
+        // patterns added back stay, and the next try resets a larger area.
+        propagator.clear();
+        wave.undo_trail(position, [&](unsigned index, unsigned pattern) {
+            propagator.restore(index, pattern);
+        });
+        repair_radius *= 2;
+    }
+    return false;
+}
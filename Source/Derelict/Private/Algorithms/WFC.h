@@ -4,6 +4,8 @@
 
 #include "CoreMinimal.h"
 
+#include <atomic>
+#include <deque>
 #include <optional>
 #include <random>
 
@@ -12,6 +14,156 @@
 #include "Algorithms/Wave.h"
 #include "Algorithms/Propagator.h"
 
+/**
+ * The way observe picks the next cell to decide.
+ */
+enum class ObservationStrategy {
+    min_entropy, // The undecided cell with the lowest entropy in the wave.
+    scanline,    // The first undecided cell in row-major order, O(1) amortized.
+    frontier     // The undecided cell with the lowest entropy around the last decided one.
+};
+
+/**
+ * Options of the generic WFC algorithm that don't depend on the model.
+ */
+struct WFCSolverOptions {
+    PropagatorEngine propagator_engine = PropagatorEngine::ac4; // The propagation algorithm.
+    ObservationStrategy observation = ObservationStrategy::min_entropy; // The cell selection.
+
+    /**
+     * The number of decisions that can be undone over a run when a
+     * contradiction is found. 0 disables backtracking: the first contradiction
+     * ends the run.
+     */
+    unsigned backtrack_budget = 0;
+
+    /**
+     * The number of most recent decisions kept on the trail. Older decisions
+     * become permanent, which bounds the memory used by the trail.
+     */
+    unsigned max_trail_depth = 64;
+
+    /**
+     * The number of local repairs allowed over a run. When a contradiction
+     * can't be backtracked, the wave goes back to before the decision that
+     * led to it, the cells around that decision are reset to their domains
+     * from before the first observation without the pattern it chose, and
+     * the run goes on. A repair still in contradiction is tried again over
+     * twice the radius, every try counting as a repair. 0 disables repairs.
+     */
+    unsigned repair_budget = 0;
+
+    /**
+     * Propagate large batches of removals on the worker threads, one band of
+     * the wave per task. AC-4 engine only. The wave after propagation is the
+     * same as with the serial propagation.
+     */
+    bool parallel_propagation = false;
+
+    /**
+     * If set, the run stops and fails as soon as the flag is raised, which is
+     * checked once per observation. Used to cancel runs from another thread.
+     */
+    const std::atomic<bool>* cancel = nullptr;
+};
+
+/**
+ * Counters of a run, used to compare the solver options.
+ */
+struct WFCStats {
+    unsigned nb_observations = 0;   // The number of cells decided by observe.
+    unsigned nb_contradictions = 0; // The number of times the wave was found in contradiction.
+    unsigned nb_backtracks = 0;     // The number of decisions undone.
+    unsigned nb_repairs = 0;        // The number of contradictions repaired locally.
+    unsigned nb_aborts = 0;         // The number of runs aborted by the connectivity checks.
+};
+
+/**
+ * Constraints on some cells of a wave, applied at once by
+ * WFC::apply_constraints. Every constrained cell has a mask of the patterns it
+ * may keep, packed as in Wave. A cell given several masks keeps the patterns
+ * allowed by all of them.
+ */
+struct WFCConstraints {
+    unsigned nb_words;                                // The number of words of a mask.
+    std::vector<std::pair<unsigned, unsigned>> cells; // The (i, j) cell of every mask.
+    std::vector<uint64_t> masks;                      // The masks, one after the other.
+
+    explicit WFCConstraints(std::size_t nb_patterns) noexcept
+        : nb_words(static_cast<unsigned>((nb_patterns + 63) / 64)) {}
+
+    /**
+     * Add a mask for cell (i, j) allowing no pattern, and return it.
+     * The pointer is only valid until the next call.
+     */
+    uint64_t* add_cell(unsigned i, unsigned j) noexcept {
+        cells.emplace_back(i, j);
+        masks.resize(masks.size() + nb_words, 0);
+        return &masks[masks.size() - nb_words];
+    }
+
+    /**
+     * Only allow pattern in cell (i, j).
+     */
+    void add(unsigned i, unsigned j, unsigned pattern) noexcept {
+        add_cell(i, j)[pattern >> 6] |= uint64_t(1) << (pattern & 63);
+    }
+
+    /**
+     * Return the mask of the n-th constrained cell.
+     */
+    const uint64_t* get_mask(std::size_t n) const noexcept {
+        return &masks[n * nb_words];
+    }
+
+    std::size_t size() const noexcept { return cells.size(); }
+};
+
+/**
+ * A global constraint keeping some cells of the wave connected, through the
+ * cells that can still have a walkable pattern. Two cells are connected when
+ * they are next to each other, as in the propagator.
+ */
+struct WFCConnectivity {
+    std::vector<uint64_t> walkable; // The walkable patterns, packed as in Wave.
+    std::vector<unsigned> required; // The cells to connect, as i * wave_width + j.
+
+    /**
+     * If 0, the constraint is enforced during the run. Otherwise, it is only
+     * checked, and the run is aborted as soon as it can't hold anymore: a
+     * required cell without walkable pattern is looked for after every
+     * propagation, and the connection every abort_interval observations.
+     */
+    unsigned abort_interval = 0;
+};
+
+/**
+ * The state of a WFC once the constraints set before the run are propagated,
+ * which doesn't depend on the seed. It is taken once, and restored in the
+ * WFCs of other seeds sharing the same rules, size and constraints instead of
+ * applying the constraints again.
+ */
+struct WFCSnapshot {
+    Wave::Snapshot wave;
+    Propagator::Snapshot propagator;
+
+    /**
+     * Return the memory held by the snapshot, in bytes.
+     */
+    std::size_t get_memory_size() const noexcept {
+        const EntropyMemoisation& memoisation = wave.memoisation;
+        std::size_t bytes = wave.data.size() * sizeof(uint64_t) +
+            (memoisation.plogp_sum.size() + memoisation.sum.size() +
+                memoisation.log_sum.size() + memoisation.entropy.size()) * sizeof(double) +
+            memoisation.nb_patterns.size() * sizeof(unsigned);
+        for (unsigned direction = 0; direction < 4; direction++) {
+            bytes += propagator.compatible_8[direction].size() * sizeof(uint8_t) +
+                propagator.compatible_16[direction].size() * sizeof(uint16_t);
+        }
+        return bytes;
+    }
+};
+
 /**
  * Class containing the generic WFC algorithm.
  */
@@ -42,6 +194,142 @@ private:
      */
     Propagator propagator;
 
+    /**
+     * The options of the solver.
+     */
+    const WFCSolverOptions solver_options;
+
+    /**
+     * A decision taken by observe, with the wave trail position just before
+     * it was applied.
+     */
+    struct Decision {
+        unsigned cell;
+        unsigned pattern;
+        std::size_t wave_position;
+    };
+
+    /**
+     * The decisions that can still be undone, oldest first. Once the trail is
+     * full, the oldest one is popped on every observation.
+     */
+    std::deque<Decision> decisions;
+
+    /**
+     * The counters of the run.
+     */
+    WFCStats stats;
+
+    /**
+     * Scanline strategy only. Every cell before scanline_cursor is decided.
+     */
+    unsigned scanline_cursor;
+
+    /**
+     * The last cell decided, or -1, the pattern it was given and the trail
+     * position just before it was decided. After a backtrack, the decision
+     * last undone. Frontier strategy: the next cell is looked for within
+     * FRONTIER_RADIUS of last_cell.
+     */
+    static constexpr int FRONTIER_RADIUS = 2;
+    int last_cell;
+    unsigned last_pattern;
+    std::size_t last_cell_position;
+
+    /**
+     * Repairs only. The words of the wave once the constraints set before the
+     * run were propagated, or empty if they are in contradiction or repairs
+     * are disabled.
+     */
+    std::vector<uint64_t> initial_domains;
+
+    /**
+     * Repairs only. The radius of the last repair, and the area it reset,
+     * [repair_y0, repair_y1) x [repair_x0, repair_x1). A contradiction in that
+     * area means it was too small, so the next repair doubles the radius.
+     */
+    static constexpr unsigned REPAIR_RADIUS = 2;
+    unsigned repair_radius;
+    unsigned repair_y0, repair_x0, repair_y1, repair_x1;
+
+    /**
+     * True if the output is toric, for the connectivity constraint.
+     */
+    const bool periodic_output;
+
+    /**
+     * The connectivity constraint, with no required cell if there is none.
+     * walkable_cells[cell] is 1 if the cell can still have a walkable
+     * pattern, as of the last check, and the other vectors are the state of
+     * the searches of enforce_connectivity and is_doomed, indexed by cell.
+     */
+    WFCConnectivity connectivity;
+    std::vector<uint8_t> walkable_cells;
+    std::vector<int> cut_order;
+    std::vector<int> cut_low;
+    std::vector<unsigned> cut_required;
+    std::vector<std::pair<unsigned, unsigned>> cut_stack;
+
+    /**
+     * Propagate, then enforce the connectivity constraint until nothing
+     * changes. Every cut between two required cells, a cell whose removal
+     * would disconnect them, is restricted to its walkable patterns. If a
+     * required cell can't be reached anymore, it is emptied, so the wave is
+     * in contradiction and the usual backtracking applies.
+     */
+    void propagate_all() noexcept;
+
+    /**
+     * Restrict the cuts between the required cells to their walkable
+     * patterns, or empty an unreachable required cell. The search is skipped
+     * when no cell lost or regained its walkable patterns since the last
+     * check. Return true if the wave was changed.
+     */
+    bool enforce_connectivity() noexcept;
+
+    /**
+     * Abort mode of the connectivity constraint only. Return true if a
+     * required cell can't be walkable anymore or, every abort_interval
+     * observations, if the cells that can still be walkable don't connect
+     * the required cells.
+     */
+    bool is_doomed() noexcept;
+
+    /**
+     * Update walkable_cells from the cells the wave reports as flipped, and
+     * return true if the searched cells changed. Everything is recomputed
+     * once walkable_cells is cleared, which is done whenever patterns are
+     * added back, since the cuts restricted since are added back too.
+     */
+    bool update_walkable_cells() noexcept;
+
+    /**
+     * Return the cell next to cell in direction, or -1 if there is none.
+     */
+    int get_neighbour(unsigned cell, unsigned direction) const noexcept;
+
+    /**
+     * Go back to the wave before last_cell was decided, reset the cells
+     * around it to their initial domains without last_pattern and propagate,
+     * doubling the radius until the wave isn't in contradiction. Return false
+     * if the repair budget is spent or if the whole wave was reset.
+     */
+    bool repair() noexcept;
+
+    /**
+     * Return the index of the next cell to decide according to the
+     * observation strategy. If there is a contradiction in the wave, return
+     * -2. If every cell is decided, return -1.
+     */
+    int select_cell() noexcept;
+
+    /**
+     * Undo decisions until the wave isn't in contradiction, banning the
+     * pattern chosen by every undone decision. Return false if there is no
+     * decision left to undo, or if the backtrack budget is spent.
+     */
+    bool backtrack() noexcept;
+
     /**
      * Transform the wave to a valid output (a 2d array of patterns that aren't in
      * contradiction). This function should be used only when all cell of the wave
@@ -51,11 +339,13 @@ private:
 
 public:
     /**
-     * Basic constructor initializing the algorithm.
+     * Basic constructor initializing the algorithm. The compatibility lists
+     * are shared, so several instances can use the same rules.
      */
     WFC(bool periodic_output, int seed, std::vector<double> patterns_frequencies,
-        Propagator::PropagatorState propagator, unsigned wave_height,
-        unsigned wave_width)
+        std::shared_ptr<const Propagator::PropagatorState> propagator,
+        unsigned wave_height,
+        unsigned wave_width, const WFCSolverOptions& solver_options = {})
         noexcept;
 
     /**
@@ -77,10 +367,26 @@ public:
      */
     ObserveStatus observe() noexcept;
 
+    /**
+     * Return the number of decisions undone since the beginning of the run.
+     */
+    unsigned get_nb_backtracks() const noexcept { return stats.nb_backtracks; }
+
+    /**
+     * Return the counters of the run.
+     */
+    const WFCStats& get_stats() const noexcept { return stats; }
+
     /**
      * Propagate the information of the wave.
      */
-    void propagate() noexcept { propagator.propagate(wave); }
+    void propagate() noexcept { propagate_all(); }
+
+    /**
+     * Require the cells of connectivity.required to stay connected through
+     * walkable cells, from now on.
+     */
+    void set_connectivity(WFCConnectivity constraint) noexcept;
 
     /**
      * Remove pattern from cell (i,j).
@@ -91,4 +397,37 @@ public:
             propagator.add_to_propagator(i, j, pattern);
         }
     }
+
+    /**
+     * Remove from cell (i,j) every pattern whose bit isn't set in mask, which
+     * has as many words as a cell of the wave. As with remove_wave_pattern,
+     * the removals are propagated by the next call to propagate.
+     */
+    void constrain(unsigned i, unsigned j, const uint64_t* mask) noexcept;
+
+    /**
+     * Constrain every cell of constraints, then propagate once.
+     * Return false if the wave is in contradiction.
+     */
+    bool apply_constraints(const WFCConstraints& constraints) noexcept;
+
+    /**
+     * Return the state of the wave and of the propagator. Must be called
+     * before the run, once the constraints are propagated.
+     */
+    WFCSnapshot snapshot() const noexcept {
+        return { wave.snapshot(), propagator.snapshot() };
+    }
+
+    /**
+     * Replace the state of the wave and of the propagator with a snapshot of
+     * a WFC with the same rules, size and solver options. Must be called
+     * before the run. The connectivity constraint is kept, and checked again
+     * from the restored wave.
+     */
+    void restore_snapshot(const WFCSnapshot& snapshot) noexcept {
+        wave.restore_snapshot(snapshot.wave);
+        propagator.restore_snapshot(snapshot.propagator);
+        walkable_cells.clear();
+    }
 };
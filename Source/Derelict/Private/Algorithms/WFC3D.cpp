@@ -0,0 +1,175 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "Algorithms/WFC3D.h"
+#include "Algorithms/OverlappingWFC3D.h"
+
+namespace {
+    /**
+     * Normalize a vector so the sum of its elements is equal to 1.0f
+     */
+    std::vector<double>& normalize(std::vector<double>& v) {
+        double sum_weights = 0.0;
+        for (double weight : v) {
+            sum_weights += weight;
+        }
+
+        double inv_sum_weights = 1.0 / sum_weights;
+        for (double& weight : v) {
+            weight *= inv_sum_weights;
+        }
+
+        return v;
+    }
+}
+
+
+Array3D<unsigned> WFC3D::wave_to_output() const noexcept {
+    Array3D<unsigned> output_patterns(depth, height, width);
+    for (unsigned i = 0; i < wave.size; i++) {
+        output_patterns.data[i] = wave.get_first_pattern(i);
+    }
+    return output_patterns;
+}
+
+WFC3D::WFC3D(bool periodic_output, int seed,
+    std::vector<double> patterns_frequencies,
+    std::shared_ptr<const Propagator3D::PropagatorState> propagator,
+    unsigned wave_depth, unsigned wave_height, unsigned wave_width,
+    const WFCSolverOptions& solver_options)
+    noexcept
+    : gen(seed), patterns_frequencies(normalize(patterns_frequencies)),
+    wave(wave_depth * wave_height, wave_width, patterns_frequencies, gen),
+    depth(wave_depth), height(wave_height), width(wave_width),
+    nb_patterns(propagator->size()),
+    propagator(wave_depth, wave_height, wave_width, periodic_output, std::move(propagator),
+        solver_options.propagator_engine),
+    solver_options(solver_options) {
+    // A volume input is usually only a few decks deep, so some patterns can't
+    // have anything above or below them.
+    this->propagator.remove_unsupported(wave);
+}
+
+std::optional<Array3D<unsigned>> WFC3D::run() noexcept {
+    // The constraints set before the run are propagated first. They are never
+    // undone, only the decisions taken from now on are recorded.
+    propagator.propagate(wave);
+    wave.set_trail_enabled(solver_options.backtrack_budget > 0);
+
+    while (true) {
+
+        if (solver_options.cancel &&
+            solver_options.cancel->load(std::memory_order_relaxed)) {
+            return std::nullopt;
+        }
+
+        // Define the value of an undefined cell.
+        ObserveStatus result = observe();
+
+        // Check if the algorithm has terminated.
+        if (result == failure) {
+            if (backtrack()) {
+                continue;
+            }
+            return std::nullopt;
+        }
+        else if (result == success) {
+            return wave_to_output();
+        }
+
+        // Propagate the information.
+        propagator.propagate(wave);
+    }
+}
+
+WFC3D::ObserveStatus WFC3D::observe() noexcept {
+    // Get the cell with lowest entropy.
+    int argmin = wave.get_min_entropy();
+
+    // If there is a contradiction, the algorithm has failed.
+    if (argmin == -2) {
+        stats.nb_contradictions++;
+        return failure;
+    }
+
+    // If the lowest entropy is 0, then the algorithm has succeeded and
+    // finished.
+    if (argmin == -1) {
+        return success;
+    }
+
+    // Choose an element according to the pattern distribution
+    double s = 0;
+    wave.for_each_pattern(argmin, [&](unsigned k) {
+        s += patterns_frequencies[k];
+    });
+
+    std::uniform_real_distribution<> dis(0, s);
+    double random_value = dis(gen);
+    size_t chosen_value = nb_patterns;
+
+    wave.for_each_pattern(argmin, [&](unsigned k) {
+        if (chosen_value != nb_patterns) {
+            return;
+        }
+        random_value -= patterns_frequencies[k];
+        if (random_value <= 0) {
+            chosen_value = k;
+        }
+    });
+
+    // Rounding can leave random_value slightly positive, in which case the last
+    // possible pattern is chosen.
+    if (chosen_value == nb_patterns) {
+        wave.for_each_pattern(argmin, [&](unsigned k) { chosen_value = k; });
+    }
+
+    // Remember the decision so it can be undone, keeping only the most recent
+    // ones.
+    if (solver_options.backtrack_budget > 0) {
+        decisions.push_back({ static_cast<unsigned>(argmin),
+            static_cast<unsigned>(chosen_value), wave.get_trail_position() });
+        if (decisions.size() > solver_options.max_trail_depth) {
+            decisions.pop_front();
+            wave.drop_trail_before(decisions.front().wave_position);
+        }
+    }
+
+    // And define the cell with the pattern.
+    stats.nb_observations++;
+    wave.for_each_pattern(argmin, [&](unsigned k) {
+        if (k != chosen_value) {
+            propagator.add_to_propagator(argmin, k);
+            wave.set(argmin, k, false);
+        }
+    });
+
+    return to_continue;
+}
+
+bool WFC3D::backtrack() noexcept {
+    while (!decisions.empty() && stats.nb_backtracks < solver_options.backtrack_budget) {
+        Decision decision = decisions.back();
+        decisions.pop_back();
+        stats.nb_backtracks++;
+
+        // Go back to the state just before the decision, as in WFC::backtrack.
+        propagator.clear();
+        wave.undo_trail(decision.wave_position, [&](unsigned index, unsigned pattern) {
+            propagator.restore(index, pattern);
+        });
+
+        // The chosen pattern leads to a contradiction, so it is banned.
+        wave.set(decision.cell, decision.pattern, false);
+        propagator.add_to_propagator(decision.cell, decision.pattern);
+        propagator.propagate(wave);
+
+        if (!wave.is_contradiction()) {
+            return true;
+        }
+        stats.nb_contradictions++;
+    }
+    return false;
+}
+
+// The volume model is only used on TCHAR volumes, it is compiled once here. 
+template class OverlappingWFC3D<TCHAR>;
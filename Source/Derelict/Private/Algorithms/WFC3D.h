@@ -0,0 +1,146 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include <deque>
+#include <optional>
+#include <random>
+
+#include "Algorithms/array3D.h"
+#include "Algorithms/Wave.h"
+#include "Algorithms/Propagator3D.h"
+#include "Algorithms/WFC.h"
+
+/**
+ * Class containing the generic WFC algorithm on a volume, made of decks of
+ * height * width cells. The wave is the 2D one, seen as depth * height rows,
+ * so cell (z, y, x) has index (z * height + y) * width + x.
+ * Observations always pick the lowest entropy, and contradictions are only
+ * backtracked: the observation, repair_budget and parallel_propagation
+ * solver options are ignored.
+ */
+class WFC3D {
+private:
+    /**
+     * The random number generator.
+     */
+    std::minstd_rand gen;
+
+    /**
+     * The distribution of the patterns as given in input.
+     */
+    const std::vector<double> patterns_frequencies;
+
+    /**
+     * The wave, indicating which patterns can be put in which cell.
+     */
+    Wave wave;
+
+    /**
+     * The size of the wave, in cells.
+     */
+    const unsigned depth;
+    const unsigned height;
+    const unsigned width;
+
+    /**
+     * The number of distinct patterns.
+     */
+    const size_t nb_patterns;
+
+    /**
+     * The propagator, used to propagate the information in the wave.
+     */
+    Propagator3D propagator;
+
+    /**
+     * The options of the solver.
+     */
+    const WFCSolverOptions solver_options;
+
+    /**
+     * A decision taken by observe, with the wave trail position just before
+     * it was applied.
+     */
+    struct Decision {
+        unsigned cell;
+        unsigned pattern;
+        std::size_t wave_position;
+    };
+
+    /**
+     * The decisions that can still be undone, oldest first.
+     */
+    std::deque<Decision> decisions;
+
+    /**
+     * The counters of the run.
+     */
+    WFCStats stats;
+
+    /**
+     * Undo decisions until the wave isn't in contradiction, banning the
+     * pattern chosen by every undone decision. Return false if there is no
+     * decision left to undo, or if the backtrack budget is spent.
+     */
+    bool backtrack() noexcept;
+
+    /**
+     * Transform the wave to a valid output. This function should be used only
+     * when all cell of the wave are defined.
+     */
+    Array3D<unsigned> wave_to_output() const noexcept;
+
+public:
+    /**
+     * Basic constructor initializing the algorithm. The compatibility lists
+     * are shared, so several instances can use the same rules.
+     */
+    WFC3D(bool periodic_output, int seed, std::vector<double> patterns_frequencies,
+        std::shared_ptr<const Propagator3D::PropagatorState> propagator,
+        unsigned wave_depth, unsigned wave_height, unsigned wave_width,
+        const WFCSolverOptions& solver_options = {}) noexcept;
+
+    /**
+     * Run the algorithm, and return a result if it succeeded. The result is an
+     * Array3D<unsigned>(depth, height, width), indexed get(z, y, x).
+     */
+    std::optional<Array3D<unsigned>> run() noexcept;
+
+    /**
+     * Return value of observe.
+     */
+    enum ObserveStatus {
+        success,    // WFC has finished and has succeeded.
+        failure,    // WFC has finished and failed.
+        to_continue // WFC isn't finished.
+    };
+
+    /**
+     * Define the value of the cell with lowest entropy.
+     */
+    ObserveStatus observe() noexcept;
+
+    /**
+     * Return the counters of the run.
+     */
+    const WFCStats& get_stats() const noexcept { return stats; }
+
+    /**
+     * Propagate the information of the wave.
+     */
+    void propagate() noexcept { propagator.propagate(wave); }
+
+    /**
+     * Remove pattern from cell (z, y, x).
+     */
+    void remove_wave_pattern(unsigned z, unsigned y, unsigned x, unsigned pattern) noexcept {
+        unsigned index = (z * height + y) * width + x;
+        if (wave.get(index, pattern)) {
+            wave.set(index, pattern, false);
+            propagator.add_to_propagator(index, pattern);
+        }
+    }
+};
@@ -3,11 +3,16 @@
 
 #include "Algorithms/WFC_Interface.h"
 #include "Algorithms/FloodFill.h"
+#include "Algorithms/OverlappingWFCRulesFile.h"
 #include "Util/DebugPrinting.h"
+#include "Async/ParallelFor.h"
+#include "Misc/FileHelper.h"
 
 #include <random>
 #include <algorithm>
 #include <variant>
+#include <atomic>
+#include <type_traits>
 
 template <typename TPreset>
 Array2D<TCHAR> WFC_Interface<TPreset>::ReadImage_CSV(UDataTable* Data, bool DebugString) const {
@@ -48,17 +53,116 @@ Array2D<TCHAR> WFC_Interface<TPreset>::ReadImage_CSV(UDataTable* Data, bool Debu
 }
 
 template <typename TPreset>
-WFC_Interface<TPreset>::Generate_WFC_Region_Output WFC_Interface<TPreset>::Generate_WFC_Region(
-    const Array2D<TCHAR>& seed, location_t size, std::vector<EDir> exits_in, RegionLabel region_label) {
+std::shared_ptr<const typename WFC_Interface<TPreset>::WFC_Tileset> WFC_Interface<TPreset>::ReadTileset(UDataTable* Tiles, UDataTable* Neighbours) const {
+    if (!Tiles || !Neighbours) {
+        UE_LOG(LogTemp, Error, TEXT("DataTable null."));
+        return nullptr;
+    }
 
-    const auto& current_region_properties = WFC_SPECIFICATIONS[region_label].properties;
+    TArray<TPair<FString, FWFCTile_Row>> TileRows;
+    Tiles->ForeachRow<FWFCTile_Row>(TEXT("Loading tiles for WFC"), [&](const FName& Key, const FWFCTile_Row& Row) {
+        TileRows.Emplace(Key.ToString(), Row);
+    });
+    TArray<TPair<FString, FWFCNeighbour_Row>> NeighbourRows;
+    Neighbours->ForeachRow<FWFCNeighbour_Row>(TEXT("Loading tile neighbours for WFC"), [&](const FName& Key, const FWFCNeighbour_Row& Row) {
+        NeighbourRows.Emplace(Key.ToString(), Row);
+    });
+    return MakeTileset(TileRows, NeighbourRows);
+}
 
-    // Make room for border
-    auto crop_amt = PATTERNS_SIZE - 1;
-    size.x += crop_amt * 2;
-    size.y += crop_amt * 2;
+template <typename TPreset>
+std::shared_ptr<const typename WFC_Interface<TPreset>::WFC_Tileset> WFC_Interface<TPreset>::ReadTileset_CSV(const FString& TilesPath, const FString& NeighboursPath) const {
+    // The rows of a file, split in cells, without the header. 
+    auto ReadRows = [](const FString& Path, int32 NumCells, TArray<TArray<FString>>& Rows) {
+        TArray<FString> Lines;
+        if (!FFileHelper::LoadFileToStringArray(Lines, *Path)) {
+            UE_LOG(LogTemp, Error, TEXT("Can't read %s."), *Path);
+            return false;
+        }
+        for (int32 i = 1; i < Lines.Num(); i++) {
+            if (Lines[i].IsEmpty()) continue;
+            TArray<FString> Cells;
+            Lines[i].ParseIntoArray(Cells, TEXT(","), false);
+            if (Cells.Num() != NumCells) {
+                UE_LOG(LogTemp, Error, TEXT("Invalid line %d of %s."), i + 1, *Path);
+                return false;
+            }
+            Rows.Add(MoveTemp(Cells));
+        }
+        return true;
+    };
 
-    // Config
+    TArray<TArray<FString>> TileCells, NeighbourCells;
+    if (!ReadRows(TilesPath, 4, TileCells) || !ReadRows(NeighboursPath, 5, NeighbourCells)) return nullptr;
+
+    TArray<TPair<FString, FWFCTile_Row>> TileRows;
+    for (const TArray<FString>& Cells : TileCells) {
+        FWFCTile_Row Row;
+        Row.Symmetry = Cells[1];
+        Row.Weight = FCString::Atof(*Cells[2]);
+        Row.Pixels = Cells[3];
+        TileRows.Emplace(Cells[0], Row);
+    }
+    TArray<TPair<FString, FWFCNeighbour_Row>> NeighbourRows;
+    for (const TArray<FString>& Cells : NeighbourCells) {
+        FWFCNeighbour_Row Row;
+        Row.Left = Cells[1];
+        Row.LeftOrientation = FCString::Atoi(*Cells[2]);
+        Row.Right = Cells[3];
+        Row.RightOrientation = FCString::Atoi(*Cells[4]);
+        NeighbourRows.Emplace(Cells[0], Row);
+    }
+    return MakeTileset(TileRows, NeighbourRows);
+}
+
+template <typename TPreset>
+std::shared_ptr<const typename WFC_Interface<TPreset>::WFC_Tileset> WFC_Interface<TPreset>::MakeTileset(
+    const TArray<TPair<FString, FWFCTile_Row>>& TileRows, const TArray<TPair<FString, FWFCNeighbour_Row>>& NeighbourRows) const {
+    bool valid = true;
+
+    // Tiles, in table order. The rows of pixels are separated by '/'. 
+    std::vector<Tile<TCHAR>> tiles;
+    TMap<FString, unsigned> tile_ids;
+    for (const auto& [Key, Row] : TileRows) {
+        TArray<FString> Lines;
+        Row.Pixels.ParseIntoArray(Lines, TEXT("/"));
+        std::optional<Symmetry> symmetry = Row.Symmetry.Len() == 1 ? to_symmetry(Row.Symmetry[0]) : std::nullopt;
+        bool square = Lines.Num() == PATTERNS_SIZE;
+        for (const FString& Line : Lines) square = square && Line.Len() == PATTERNS_SIZE;
+        if (!symmetry || !square || Row.Weight <= 0.f) {
+            UE_LOG(LogTemp, Error, TEXT("Invalid WFC tile %s."), *Key);
+            valid = false;
+            continue;
+        }
+
+        Array2D<TCHAR> data(PATTERNS_SIZE, PATTERNS_SIZE);
+        for (int32 i = 0; i < PATTERNS_SIZE; i++) for (int32 j = 0; j < PATTERNS_SIZE; j++)
+            data.get(i, j) = Lines[i][j];
+        tile_ids.Add(Key, static_cast<unsigned>(tiles.size()));
+        tiles.emplace_back(data, *symmetry, Row.Weight);
+    }
+
+    // Neighbour rules, between tiles named by their row. 
+    std::vector<TileNeighbour> neighbours;
+    for (const auto& [Key, Row] : NeighbourRows) {
+        const unsigned* left = tile_ids.Find(Row.Left);
+        const unsigned* right = tile_ids.Find(Row.Right);
+        if (!left || !right ||
+            Row.LeftOrientation < 0 || Row.LeftOrientation >= static_cast<int32>(tiles[*left].data.size()) ||
+            Row.RightOrientation < 0 || Row.RightOrientation >= static_cast<int32>(tiles[*right].data.size())) {
+            UE_LOG(LogTemp, Error, TEXT("Invalid WFC tile neighbour %s."), *Key);
+            valid = false;
+            continue;
+        }
+        neighbours.push_back({ *left, static_cast<unsigned>(Row.LeftOrientation), *right, static_cast<unsigned>(Row.RightOrientation) });
+    }
+
+    if (!valid || tiles.empty()) return nullptr;
+    return WFC_Tileset::make(std::move(tiles), neighbours);
+}
+
+template <typename TPreset>
+OverlappingWFCOptions WFC_Interface<TPreset>::MakeOptions(location_t size) {
 	OverlappingWFCOptions options;
 	options.periodic_input =    PERIODIC_INPUT;
 	options.periodic_output =   PERIODIC_OUTPUT;
@@ -67,115 +171,305 @@ WFC_Interface<TPreset>::Generate_WFC_Region_Output WFC_Interface<TPreset>::Gener
 	options.symmetry =          SYMMETRY;
 	options.ground =            GROUND;
 	options.pattern_size =      PATTERNS_SIZE;
+	options.prune_patterns =    PRUNE_PATTERNS;
+	options.solver.propagator_engine = PROPAGATOR_ENGINE;
+	options.solver.backtrack_budget = BACKTRACK_BUDGET;
+	options.solver.repair_budget = REPAIR_BUDGET;
+	options.solver.observation = OBSERVATION;
+	options.solver.parallel_propagation = PARALLEL_PROPAGATION;
+	return options;
+}
 
-	for (size_t I = 0; I < FAIL_COUNT; I++) { // TODO - make it so this never fails. 
-		OverlappingWFC<TCHAR> wfc(seed, options, FMath::RandRange(1, MAX_INT32));
-
-        // Make exits at midpoints
-        std::vector<ExitLocation> exits;
-        exits.reserve(exits_in.size());
-        for (const auto& e : exits_in) {
-            constexpr int32 DIV = 3;
-            for (int32 v = 1; v < DIV; v++)
-                exits.push_back({ e, 
-                    (e == E_TOP || e == E_BOTTOM) ?
-                    Linspace(size.x, DIV, v) / PATTERNS_SIZE :
-                    Linspace(size.y, DIV, v) / PATTERNS_SIZE
-                });
-        }
+template <typename TPreset>
+TilingWFCOptions WFC_Interface<TPreset>::MakeTiledOptions(location_t size) {
+	TilingWFCOptions options;
+	options.periodic_output =   PERIODIC_OUTPUT;
+	options.out_height =        size.x;
+	options.out_width =         size.y;
+	options.solver =            MakeOptions(size).solver;
+	return options;
+}
 
-        PreCollapseBorder(wfc, exits);
-		auto out = wfc.run();
+template <typename TPreset>
+std::vector<Array2D<TCHAR>> WFC_Interface<TPreset>::GetBorderPatterns() {
+	std::vector<Array2D<TCHAR>> patterns;
+	auto add = [&](const pattern_t& pattern) {
+		Array2D<TCHAR> fill({ PATTERNS_SIZE, PATTERNS_SIZE }, pattern);
+		if (std::find(patterns.begin(), patterns.end(), fill) == patterns.end()) patterns.push_back(std::move(fill));
+	};
+	add(TPreset::P_EMPTY_H);
+	for (EDir side : { E_LEFT, E_TOP, E_RIGHT, E_BOTTOM }) add(*TPreset::EXIT_PATTERNS[side]);
+	return patterns;
+}
 
-        if (out.has_value()) {
+template <typename TPreset>
+bool WFC_Interface<TPreset>::LoadRules(const Array2D<TCHAR>& seed, const FString& path) {
+	// The rules don't depend on the region size. 
+	OverlappingWFCOptions options = MakeOptions(location_t{ 0, 0 });
+	auto kept = GetBorderPatterns();
+	auto rules = OverlappingWFCRulesFile<TCHAR, PATTERNS_SIZE>::load(path, seed, options, kept);
+	if (!rules) {
+		UE_LOG(LogTemp, Warning, TEXT("No valid WFC rules in %s, extracting them from the seed."), *path);
+		return false;
+	}
+	OverlappingWFCRulesCache<TCHAR, PATTERNS_SIZE>::insert(seed, options, kept, std::move(rules));
+	return true;
+}
 
-            // Only select contiguous region from an exit. Assume center is filled. 
-            check(exits.size() > 0);
-            auto out_cont = SelectByColor(*out, exits[0].offset_physical(size, true), TPreset::S_, true);
+template <typename TPreset>
+bool WFC_Interface<TPreset>::CompileRules(const Array2D<TCHAR>& seed, const FString& path) {
+	OverlappingWFCOptions options = MakeOptions(location_t{ 0, 0 });
+	auto kept = GetBorderPatterns();
+	auto rules = WFC_Model::get_rules(seed, options, kept);
+	return OverlappingWFCRulesFile<TCHAR, PATTERNS_SIZE>::save(path, seed, options, kept, *rules);
+}
 
-            // Verify there is a path from exit to entrance
-            bool invalidate = false;
-            for (const auto& exit : exits)
-                if (out_cont.get(exit.offset_physical(size, true)) == TPreset::S_) { // Check for blank spot centered at the exits
-                    invalidate = true;
-                    if (DEBUG_MESSAGES) GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("Invalid exit path"));
-                }
-            if (!invalidate) {
-                // Crop to ~border
-                out_cont = out_cont.center_crop(crop_amt);
-
-                // Generate properties grid - init
-                TileProperties init;
-                init.room_index = -1;
-                Array2D<TileProperties> property_grid(out_cont.get_size(), init);
-                int32 current_room = 0;
-                std::unordered_map<EDir, int32, EDirHash> edge_boundaries{
-                    { E_TOP, MAX_INT32 },
-                    { E_BOTTOM, 0 },
-                    { E_LEFT, MAX_INT32 },
-                    { E_RIGHT, 0 },
-                };
-
-                // Generate properties grid - first pass
-                for (int32 i = 0; i < out_cont.height; i++) for (int32 j = 0; j < out_cont.width; j++) {
-                    const TCHAR& label = out_cont.get(i, j);
-                    TileProperties& property = property_grid.get(i, j);
-
-                    property.label = label;
-
-                    // Generate room IDs
-                    if (label == TPreset::SR && property.room_index < 0) { // if it is a room but has uninitialized index
-                        auto room_fill = SelectByColor(out_cont, location_t{ i, j }, TPreset::SR, false);
-                        for (size_t i_local = 0; i_local < room_fill.height; i_local++) for (size_t j_local = 0; j_local < room_fill.width; j_local++) {
-                            if (room_fill.get(i_local, j_local) == TPreset::S_) continue;
-                            TileProperties& local_property = property_grid.get(i_local, j_local);
-                            local_property.room_index = current_room;
-                        }
-                        current_room++;
-                    }
-
-                    // Find tile boundaries for finding edge tiles
-                    if (label != TPreset::S_) {
-                        if (i < edge_boundaries[E_TOP])    edge_boundaries[E_TOP]    = i;
-                        if (j < edge_boundaries[E_LEFT])   edge_boundaries[E_LEFT]   = j;
-                        if (i > edge_boundaries[E_BOTTOM]) edge_boundaries[E_BOTTOM] = i;
-                        if (j > edge_boundaries[E_RIGHT])  edge_boundaries[E_RIGHT]  = j;
-                    }
-                };
-
-                // Generate properties grid - second pass
-                auto max_room_id = current_room - 1;
-                auto turret_room_indices = PickUniqueRandomInts(static_cast<int>(max_room_id * current_region_properties.turret_room_density), max_room_id);
-                for (size_t i = 0; i < property_grid.height; i++) for (size_t j = 0; j < property_grid.width; j++) {
-                    TileProperties& property = property_grid.get(i, j);
-
-                    // Turrets
-                    const auto &t_spacing = current_region_properties.turret_spacing;
-                    for (const auto &id : turret_room_indices)
-                        if (id == property.room_index && i % t_spacing == 0 && j % t_spacing == 0) {
-                            property.turret_level = true;
-                            break;
-                        }
-
-                    // Set edge tiles
-                    if (i == edge_boundaries[E_TOP])    property.edge_indicators[E_TOP]    = true;
-                    if (j == edge_boundaries[E_LEFT])   property.edge_indicators[E_LEFT]   = true;
-                    if (i == edge_boundaries[E_BOTTOM]) property.edge_indicators[E_BOTTOM] = true;
-                    if (j == edge_boundaries[E_RIGHT])  property.edge_indicators[E_RIGHT]  = true;
-                }
-
-                // Return final output
-                return { out_cont, property_grid };
+template <typename TPreset>
+std::vector<typename WFC_Interface<TPreset>::ExitLocation> WFC_Interface<TPreset>::MakeExits(location_t size, const std::vector<EDir>& exits_in) {
+    // Make exits at midpoints
+    std::vector<ExitLocation> exits;
+    exits.reserve(exits_in.size());
+    for (const auto& e : exits_in) {
+        constexpr int32 DIV = 3;
+        for (int32 v = 1; v < DIV; v++)
+            exits.push_back({ e, 
+                (e == E_TOP || e == E_BOTTOM) ?
+                Linspace(size.x, DIV, v) / PATTERNS_SIZE :
+                Linspace(size.y, DIV, v) / PATTERNS_SIZE
+            });
+    }
+    return exits;
+}
+
+template <typename TPreset>
+WFC_Interface<TPreset>::Generate_WFC_Region_Output WFC_Interface<TPreset>::Generate_WFC_Region(
+    const Array2D<TCHAR>& seed, location_t size, std::vector<EDir> exits_in, RegionLabel region_label) {
+
+    // Make room for border
+    auto crop_amt = PATTERNS_SIZE - 1;
+    size.x += crop_amt * 2;
+    size.y += crop_amt * 2;
+
+    // Config
+	OverlappingWFCOptions options = MakeOptions(size);
+    std::vector<ExitLocation> exits = MakeExits(size, exits_in);
+    check(exits.size() > 0);
+
+    // The rules are looked up once per region, before the attempts. The border patterns are kept by the pruning, so
+    // PreCollapseBorder can set them. 
+    auto rules = WFC_Model::get_rules(seed, options, GetBorderPatterns());
+
+    return Run_WFC_Attempts([&](int32 attempt_seed, const std::atomic<bool>* cancel) {
+        OverlappingWFCOptions attempt_options = options;
+        attempt_options.solver.cancel = cancel;
+        return Attempt_WFC_Region(seed, rules, attempt_options, exits, attempt_seed);
+    }, region_label);
+}
+
+template <typename TPreset>
+WFC_Interface<TPreset>::Generate_WFC_Region_Output WFC_Interface<TPreset>::Generate_Tiled_Region(
+    std::shared_ptr<const WFC_Tileset> tileset, location_t size, std::vector<EDir> exits_in, RegionLabel region_label) {
+
+    // Make room for border
+    auto crop_amt = PATTERNS_SIZE - 1;
+    size.x += crop_amt * 2;
+    size.y += crop_amt * 2;
+
+    // The border and the exits are set on the tile grid, so the bottom and right border need whole tiles. 
+    if (size.x % PATTERNS_SIZE != 0 || size.y % PATTERNS_SIZE != 0) {
+        UE_LOG(LogTemp, Error, TEXT("Tiled WFC region of %dx%d with its border isn't a whole number of %d pixel tiles."),
+            size.x, size.y, PATTERNS_SIZE);
+        return Generate_WFC_Region_Output::dummy();
+    }
+
+    // Config
+    TilingWFCOptions options = MakeTiledOptions(size);
+    std::vector<ExitLocation> exits = MakeExits(size, exits_in);
+    check(exits.size() > 0);
+
+    return Run_WFC_Attempts([&](int32 attempt_seed, const std::atomic<bool>* cancel) {
+        TilingWFCOptions attempt_options = options;
+        attempt_options.solver.cancel = cancel;
+        return Attempt_Tiled_Region(tileset, attempt_options, exits, attempt_seed);
+    }, region_label);
+}
+
+template <typename TPreset>
+template <typename TAttempt>
+WFC_Interface<TPreset>::Generate_WFC_Region_Output WFC_Interface<TPreset>::Run_WFC_Attempts(TAttempt&& attempt, RegionLabel region_label) {
+	for (size_t first = 0; first < FAIL_COUNT; first += PARALLEL_ATTEMPTS) { // TODO - make it so this never fails. 
+        const int32 batch = static_cast<int32>(std::min(PARALLEL_ATTEMPTS, FAIL_COUNT - first));
+
+        // Seeds are drawn in order on this thread, and the winner is the first successful attempt in that order,
+        // so the result only depends on the random stream, not on scheduling or on the number of worker threads. 
+        std::vector<int32> attempt_seeds(batch);
+        for (int32 k = 0; k < batch; k++) attempt_seeds[k] = FMath::RandRange(1, MAX_INT32);
+
+        // A success cancels the attempts after it, which can't win anymore. When the batch runs on fewer threads
+        // than attempts, the cancelled attempts that haven't started yet are skipped. 
+        std::vector<WFC_Attempt_Output> attempts(batch);
+        std::vector<std::atomic<bool>> cancel(batch);
+        ParallelFor(batch, [&](int32 k) {
+            attempts[k] = attempt(attempt_seeds[k], &cancel[k]);
+            if (attempts[k].status == WFC_Attempt_Output::success)
+                for (int32 later = k + 1; later < batch; later++) cancel[later].store(true, std::memory_order_relaxed);
+        }, batch == 1);
+
+        for (auto& result : attempts) {
+            generation_stats.attempts++;
+            switch (result.status) {
+            case WFC_Attempt_Output::success:           generation_stats.successes++; break;
+            case WFC_Attempt_Output::constrained:       generation_stats.constrained++; break;
+            case WFC_Attempt_Output::invalid_exit_path: generation_stats.invalid_exit_paths++; break;
+            case WFC_Attempt_Output::aborted:           generation_stats.aborted++; break;
+            case WFC_Attempt_Output::cancelled:         generation_stats.cancelled++; break;
             }
         }
-        else {
-            if (DEBUG_MESSAGES) GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("WFC constrained too much"));
+        for (auto& result : attempts) {
+            if (result.status == WFC_Attempt_Output::success)
+                return Build_WFC_Region_Output(result.region, region_label);
+            if (DEBUG_MESSAGES && result.status == WFC_Attempt_Output::invalid_exit_path)
+                GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("Invalid exit path"));
+            if (DEBUG_MESSAGES && result.status == WFC_Attempt_Output::constrained)
+                GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("WFC constrained too much"));
         }
 	}
     GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("Failed WFC too many times"));
 	return Generate_WFC_Region_Output::dummy();
 }
 
+template <typename TPreset>
+WFC_Interface<TPreset>::WFC_Attempt_Output WFC_Interface<TPreset>::Attempt_WFC_Region(
+    const Array2D<TCHAR>& seed, std::shared_ptr<const typename WFC_Model::Rules> rules, const OverlappingWFCOptions& options,
+    const std::vector<ExitLocation>& exits, int32 attempt_seed) {
+    location_t size = { static_cast<int32>(options.out_height), static_cast<int32>(options.out_width) };
+    if (options.solver.cancel && options.solver.cancel->load(std::memory_order_relaxed))
+        return { WFC_Attempt_Output::cancelled, {} };
+
+    // Large regions are solved chunk by chunk, so memory only depends on the chunk size. 
+    auto solve = [&](auto& wfc) {
+        auto out = wfc.run();
+        return Finish_WFC_Attempt(out, wfc.get_stats(), size, exits, options.solver.cancel);
+    };
+    if (options.get_wave_height() > CHUNK_SIZE || options.get_wave_width() > CHUNK_SIZE) {
+        WFC_Chunked_Model wfc(seed, options, attempt_seed, rules, ChunkedWFCOptions{ CHUNK_SIZE, CHUNK_OVERLAP, CHUNK_ATTEMPTS });
+        RequireExitPaths(wfc, exits);
+        PreCollapseBorder(wfc, exits);
+        return solve(wfc);
+    }
+    WFC_Model wfc(seed, options, attempt_seed, rules);
+    RequireExitPaths(wfc, exits);
+    PreCollapseBorderCached(wfc, std::move(rules), exits);
+    return solve(wfc);
+}
+
+template <typename TPreset>
+WFC_Interface<TPreset>::WFC_Attempt_Output WFC_Interface<TPreset>::Attempt_Tiled_Region(
+    std::shared_ptr<const WFC_Tileset> tileset, const TilingWFCOptions& options, const std::vector<ExitLocation>& exits, int32 attempt_seed) {
+    location_t size = { static_cast<int32>(options.out_height), static_cast<int32>(options.out_width) };
+    if (options.solver.cancel && options.solver.cancel->load(std::memory_order_relaxed))
+        return { WFC_Attempt_Output::cancelled, {} };
+
+    WFC_Tiled_Model wfc(tileset, options, attempt_seed);
+    RequireExitPaths(wfc, exits);
+    PreCollapseBorderCached(wfc, std::move(tileset), exits);
+    auto out = wfc.run();
+    return Finish_WFC_Attempt(out, wfc.get_stats(), size, exits, options.solver.cancel);
+}
+
+template <typename TPreset>
+WFC_Interface<TPreset>::WFC_Attempt_Output WFC_Interface<TPreset>::Finish_WFC_Attempt(
+    const std::optional<Array2D<TCHAR>>& out, const WFCStats& stats, location_t size, const std::vector<ExitLocation>& exits,
+    const std::atomic<bool>* cancel) {
+    if (!out.has_value()) {
+        if (cancel && cancel->load(std::memory_order_relaxed)) return { WFC_Attempt_Output::cancelled, {} };
+        return { stats.nb_aborts > 0 ? WFC_Attempt_Output::aborted : WFC_Attempt_Output::constrained, {} };
+    }
+
+    // Only select contiguous region from an exit. Assume center is filled. 
+    auto out_cont = SelectByColor(*out, exits[0].offset_physical(size, true), TPreset::S_, true);
+
+    // Verify there is a path from exit to entrance
+    for (const auto& exit : exits)
+        if (out_cont.get(exit.offset_physical(size, true)) == TPreset::S_) // Check for blank spot centered at the exits
+            return { WFC_Attempt_Output::invalid_exit_path, {} };
+
+    return { WFC_Attempt_Output::success, std::move(out_cont) };
+}
+
+template <typename TPreset>
+WFC_Interface<TPreset>::Generate_WFC_Region_Output WFC_Interface<TPreset>::Build_WFC_Region_Output(
+    Array2D<TCHAR> out_cont, RegionLabel region_label) {
+
+    const auto& current_region_properties = WFC_SPECIFICATIONS[region_label].properties;
+
+    // Crop to ~border
+    out_cont = out_cont.center_crop(PATTERNS_SIZE - 1);
+
+    // Generate properties grid - init
+    TileProperties init;
+    init.room_index = -1;
+    Array2D<TileProperties> property_grid(out_cont.get_size(), init);
+    int32 current_room = 0;
+    std::unordered_map<EDir, int32, EDirHash> edge_boundaries{
+        { E_TOP, MAX_INT32 },
+        { E_BOTTOM, 0 },
+        { E_LEFT, MAX_INT32 },
+        { E_RIGHT, 0 },
+    };
+
+    // Generate properties grid - first pass
+    for (int32 i = 0; i < out_cont.height; i++) for (int32 j = 0; j < out_cont.width; j++) {
+        const TCHAR& label = out_cont.get(i, j);
+        TileProperties& property = property_grid.get(i, j);
+
+        property.label = label;
+
+        // Generate room IDs
+        if (label == TPreset::SR && property.room_index < 0) { // if it is a room but has uninitialized index
+            auto room_fill = SelectByColor(out_cont, location_t{ i, j }, TPreset::SR, false);
+            for (size_t i_local = 0; i_local < room_fill.height; i_local++) for (size_t j_local = 0; j_local < room_fill.width; j_local++) {
+                if (room_fill.get(i_local, j_local) == TPreset::S_) continue;
+                TileProperties& local_property = property_grid.get(i_local, j_local);
+                local_property.room_index = current_room;
+            }
+            current_room++;
+        }
+
+        // Find tile boundaries for finding edge tiles
+        if (label != TPreset::S_) {
+            if (i < edge_boundaries[E_TOP])    edge_boundaries[E_TOP]    = i;
+            if (j < edge_boundaries[E_LEFT])   edge_boundaries[E_LEFT]   = j;
+            if (i > edge_boundaries[E_BOTTOM]) edge_boundaries[E_BOTTOM] = i;
+            if (j > edge_boundaries[E_RIGHT])  edge_boundaries[E_RIGHT]  = j;
+        }
+    };
+
+    // Generate properties grid - second pass
+    auto max_room_id = current_room - 1;
+    auto turret_room_indices = PickUniqueRandomInts(static_cast<int>(max_room_id * current_region_properties.turret_room_density), max_room_id);
+    for (size_t i = 0; i < property_grid.height; i++) for (size_t j = 0; j < property_grid.width; j++) {
+        TileProperties& property = property_grid.get(i, j);
+
+        // Turrets
+        const auto &t_spacing = current_region_properties.turret_spacing;
+        for (const auto &id : turret_room_indices)
+            if (id == property.room_index && i % t_spacing == 0 && j % t_spacing == 0) {
+                property.turret_level = true;
+                break;
+            }
+
+        // Set edge tiles
+        if (i == edge_boundaries[E_TOP])    property.edge_indicators[E_TOP]    = true;
+        if (j == edge_boundaries[E_LEFT])   property.edge_indicators[E_LEFT]   = true;
+        if (i == edge_boundaries[E_BOTTOM]) property.edge_indicators[E_BOTTOM] = true;
+        if (j == edge_boundaries[E_RIGHT])  property.edge_indicators[E_RIGHT]  = true;
+    }
+
+    // Return final output
+    return { out_cont, property_grid };
+}
+
 template <typename TPreset>
 Array2D<TCHAR> WFC_Interface<TPreset>::SelectByColor(const Array2D<TCHAR>& region, location_t seed, TCHAR color, bool null) {
     std::function<bool(const TCHAR&)> selector;
@@ -185,23 +479,36 @@ Array2D<TCHAR> WFC_Interface<TPreset>::SelectByColor(const Array2D<TCHAR>& regio
 }
 
 template <typename TPreset>
-void WFC_Interface<TPreset>::PreCollapsePoints(OverlappingWFC<TCHAR>& wfc, const std::vector<location_t>& points, const pattern_t &pattern) {
+template <typename TModel>
+void WFC_Interface<TPreset>::PreCollapsePoints(TModel& wfc, WFCConstraints& constraints, const std::vector<location_t>& points, const pattern_t &pattern) {
     check(pattern.size() == PATTERNS_SIZE);
     check(pattern[0].size() == PATTERNS_SIZE);
+    if (points.empty()) return;
+
+    Array2D<TCHAR> fill({ PATTERNS_SIZE, PATTERNS_SIZE }, pattern);
+    std::optional<unsigned> pattern_id = wfc.get_pattern_id(fill);
+    if (!pattern_id) {
+        // The seed doesn't hold the pattern, or it was pruned from rules built without GetBorderPatterns: these points
+        // are left free. 
+        UE_LOG(LogTemp, Warning, TEXT("WFC pattern to set on %d points isn't in the rules."), static_cast<int32>(points.size()));
+        if (DEBUG_MESSAGES)  GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("Null pattern"));
+        return;
+    }
     for (const auto& point : points) {
-        Array2D<TCHAR> fill({ PATTERNS_SIZE, PATTERNS_SIZE }, pattern);
-        bool r = wfc.set_pattern(fill, point.x, point.y);
+        bool r = wfc.add_constraint(constraints, *pattern_id, point.x, point.y);
 
         if (!r) if (DEBUG_MESSAGES)  GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("Failed setpattern"));
     }
 }
 
 template <typename TPreset>
-void WFC_Interface<TPreset>::PreCollapseBorder(OverlappingWFC<TCHAR>& wfc, const std::vector<ExitLocation> &exits) {
+template <typename TModel>
+void WFC_Interface<TPreset>::PreCollapseBorder(TModel& wfc, const std::vector<ExitLocation> &exits) {
     location_t size = { wfc.get_options().out_height, wfc.get_options().out_width };
 
     const int32 subgrid_x = size.x / PATTERNS_SIZE;
     const int32 subgrid_y = size.y / PATTERNS_SIZE;
+    WFCConstraints constraints = wfc.make_constraints();
 
     auto side_fill = [&](int32 max_index, const EDir side) {
         std::vector<location_t> Epoints_of_interest;
@@ -216,20 +523,94 @@ void WFC_Interface<TPreset>::PreCollapseBorder(OverlappingWFC<TCHAR>& wfc, const
                 if (exit.side == side && exit.offset == j) skip = true;
             if (!skip) Epoints_of_interest.push_back(SIDE_TO_PHYSICAL(side, size, j));
         }
-        PreCollapsePoints(wfc, Epoints_of_interest, TPreset::P_EMPTY_H);
+        PreCollapsePoints(wfc, constraints, Epoints_of_interest, TPreset::P_EMPTY_H);
 
         // Exit hallways
         for (const ExitLocation& exit : exits) {
             if (exit.side == side)
                 Hpoints_of_interest.push_back(exit.offset_physical(size));
         }
-        PreCollapsePoints(wfc, Hpoints_of_interest, *TPreset::EXIT_PATTERNS[side]);
+        PreCollapsePoints(wfc, constraints, Hpoints_of_interest, *TPreset::EXIT_PATTERNS[side]);
     };
 
     side_fill(subgrid_x, E_LEFT);
     side_fill(subgrid_y, E_TOP);
     side_fill(subgrid_x, E_RIGHT);
     side_fill(subgrid_y, E_BOTTOM);
+
+    bool r = wfc.apply_constraints(constraints);
+    if (!r) if (DEBUG_MESSAGES)  GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("Contradictory border"));
+}
+
+template <typename TPreset>
+template <typename TModel>
+void WFC_Interface<TPreset>::PreCollapseBorderCached(TModel& wfc, std::shared_ptr<const void> rules, const std::vector<ExitLocation>& exits) {
+    const auto& options = wfc.get_options();
+    BorderKey key{ std::move(rules), location_t{ static_cast<int32>(options.out_height), static_cast<int32>(options.out_width) },
+        exits, options.periodic_output, false, options.solver.propagator_engine, options.solver.parallel_propagation };
+    if constexpr (requires { options.prune_patterns; }) key.prune_patterns = options.prune_patterns;
+
+    // Only the lookup is done with the cache locked. The first attempt at a key adds its entry before applying the border,
+    // so the other attempts of the first batch wait for its snapshot instead of applying the same border. 
+    std::promise<std::shared_ptr<const WFCSnapshot>> promise;
+    std::shared_future<std::shared_ptr<const WFCSnapshot>> snapshot;
+    bool found;
+    {
+        std::lock_guard<std::mutex> lock(GetBorderCacheMutex());
+        auto& cache = GetBorderCache();
+        auto it = std::find_if(cache.entries.begin(), cache.entries.end(), [&](const BorderSnapshot& entry) { return entry.key == key; });
+        found = it != cache.entries.end();
+        if (found) snapshot = it->snapshot;
+        else {
+            snapshot = promise.get_future().share();
+            cache.entries.push_back({ key, snapshot, 0 });
+        }
+    }
+    if (found) {
+        wfc.restore_snapshot(*snapshot.get());
+        return;
+    }
+
+    PreCollapseBorder(wfc, exits);
+    auto made = std::make_shared<const WFCSnapshot>(wfc.snapshot());
+    const size_t bytes = made->get_memory_size();
+    promise.set_value(std::move(made));
+
+    // The oldest snapshots are dropped once the cache is over budget, this one too if it is larger than the budget. The
+    // snapshots still being made don't count, and stay. 
+    std::lock_guard<std::mutex> lock(GetBorderCacheMutex());
+    auto& cache = GetBorderCache();
+    auto it = std::find_if(cache.entries.begin(), cache.entries.end(), [&](const BorderSnapshot& entry) { return entry.key == key; });
+    it->bytes = bytes;
+    cache.bytes += bytes;
+    for (auto entry = cache.entries.begin(); cache.bytes > BORDER_CACHE_BYTES && entry != cache.entries.end();) {
+        if (entry->bytes == 0) {
+            ++entry;
+            continue;
+        }
+        cache.bytes -= entry->bytes;
+        entry = cache.entries.erase(entry);
+    }
+}
+
+template <typename TPreset>
+template <typename TModel>
+void WFC_Interface<TPreset>::RequireExitPaths(TModel& wfc, const std::vector<ExitLocation>& exits) {
+    location_t size = { static_cast<int32>(wfc.get_options().out_height), static_cast<int32>(wfc.get_options().out_width) };
+
+    // The exit patterns are placed at the upper left corner, so their center is the center pixel of that cell. 
+    std::vector<std::pair<unsigned, unsigned>> cells;
+    cells.reserve(exits.size());
+    for (const ExitLocation& exit : exits) {
+        location_t corner = exit.offset_physical(size);
+        cells.push_back({ static_cast<unsigned>(corner.x), static_cast<unsigned>(corner.y) });
+    }
+
+    auto walkable = [](const TCHAR& t) { return t != TPreset::S_; };
+    bool r;
+    if constexpr (std::is_same_v<TModel, WFC_Chunked_Model>) r = wfc.set_connectivity(walkable, cells);
+    else r = wfc.set_connectivity(walkable, cells, EXIT_CHECK_INTERVAL);
+    if (!r) if (DEBUG_MESSAGES)  GEngine->AddOnScreenDebugMessage(-1, 999.f, FColor::Green, TEXT("Failed exit paths"));
 }
 
 template <typename TPreset>
@@ -246,4 +627,28 @@ std::vector<size_t> WFC_Interface<TPreset>::PickUniqueRandomInts(size_t N, size_
     return std::vector<size_t>(pool.begin(), pool.begin() + N);
 }
 
-template class WFC_Interface<PRESET_MediumHalls>;
\ No newline at end of file
+template class WFC_Interface<PRESET_MediumHalls>;
+
+// Every model can be pre-collapsed from outside of this file. 
+template void WFC_Interface<PRESET_MediumHalls>::PreCollapseBorder(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Model&, const std::vector<WFC_Interface<PRESET_MediumHalls>::ExitLocation>&);
+template void WFC_Interface<PRESET_MediumHalls>::PreCollapseBorder(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Chunked_Model&, const std::vector<WFC_Interface<PRESET_MediumHalls>::ExitLocation>&);
+template void WFC_Interface<PRESET_MediumHalls>::PreCollapsePoints(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Model&, WFCConstraints&, const std::vector<location_t>&, const pattern_t&);
+template void WFC_Interface<PRESET_MediumHalls>::PreCollapsePoints(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Chunked_Model&, WFCConstraints&, const std::vector<location_t>&, const pattern_t&);
+template void WFC_Interface<PRESET_MediumHalls>::PreCollapseBorder(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Tiled_Model&, const std::vector<WFC_Interface<PRESET_MediumHalls>::ExitLocation>&);
+template void WFC_Interface<PRESET_MediumHalls>::PreCollapsePoints(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Tiled_Model&, WFCConstraints&, const std::vector<location_t>&, const pattern_t&);
+template void WFC_Interface<PRESET_MediumHalls>::PreCollapseBorderCached(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Model&, std::shared_ptr<const void>, const std::vector<WFC_Interface<PRESET_MediumHalls>::ExitLocation>&);
+template void WFC_Interface<PRESET_MediumHalls>::PreCollapseBorderCached(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Tiled_Model&, std::shared_ptr<const void>, const std::vector<WFC_Interface<PRESET_MediumHalls>::ExitLocation>&);
+template void WFC_Interface<PRESET_MediumHalls>::RequireExitPaths(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Model&, const std::vector<WFC_Interface<PRESET_MediumHalls>::ExitLocation>&);
+template void WFC_Interface<PRESET_MediumHalls>::RequireExitPaths(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Tiled_Model&, const std::vector<WFC_Interface<PRESET_MediumHalls>::ExitLocation>&);
+template void WFC_Interface<PRESET_MediumHalls>::RequireExitPaths(
+    WFC_Interface<PRESET_MediumHalls>::WFC_Chunked_Model&, const std::vector<WFC_Interface<PRESET_MediumHalls>::ExitLocation>&);
\ No newline at end of file
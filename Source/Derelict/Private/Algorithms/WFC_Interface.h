@@ -6,13 +6,19 @@
 #include "Math/UnrealMathUtility.h"
 #include "Containers/Array.h"
 #include "Engine/DataTable.h"
+#include "Misc/Paths.h"
 #include "Structs/CommonStructs.h"
 
 #include "Algorithms/array2D.h"
 #include "Algorithms/OverlappingWFC.h"
+#include "Algorithms/ChunkedWFC.h"
+#include "Algorithms/TilingWFC.h"
 #include "Algorithms/Presets/Preset_WFC_Gen.h"
 
+#include <atomic>
 #include <functional>
+#include <future>
+#include <mutex>
 
 /**
  * Interface for handling WFC
@@ -29,11 +35,43 @@ template <typename TPreset> class WFC_Interface {
 	static constexpr bool			GROUND = false;
 	static constexpr int32			PATTERNS_SIZE = 3;
 	static constexpr unsigned int	SYMMETRY = 8;
+	static constexpr PropagatorEngine PROPAGATOR_ENGINE = PropagatorEngine::ac4;
+	static constexpr unsigned int	BACKTRACK_BUDGET = 32;		// Decisions undone per attempt before restarting. 0 to always restart. 
+	static constexpr unsigned int	REPAIR_BUDGET = 8;			// Contradictions repaired locally per attempt once backtracking gives up. 
+	static constexpr ObservationStrategy OBSERVATION = ObservationStrategy::min_entropy;
+	static constexpr bool			PARALLEL_PROPAGATION = true;	// Propagate the border constraints of large waves on the worker threads. 
+	static constexpr bool			PRUNE_PATTERNS = true;		// Remove the patterns that can't be placed inside a region. The border sets the edges. 
 
 	// The max number of times to fail WFC before exiting. 
 	static constexpr size_t FAIL_COUNT = 100;
 
+	// The number of attempts run at once on the worker threads. The first successful one, in seed order, wins. 
+	// 1 to run the attempts one after another. 
+	static constexpr size_t PARALLEL_ATTEMPTS = 4;
+
+	// Regions whose wave is larger than this, in cells, are solved one chunk at a time so memory stays bounded. 
+	static constexpr unsigned int	CHUNK_SIZE = 48;
+	static constexpr unsigned int	CHUNK_OVERLAP = 4;			// Cells shared by neighbouring chunks, and added to a chunk on every retry. 
+	static constexpr unsigned int	CHUNK_ATTEMPTS = 4;
+
+	// Observations between two checks that the exits can still be connected, aborting the attempt when they can't. 
+	// 0 to enforce the exit paths during the run instead. Chunked regions are checked once per chunk either way. 
+	static constexpr unsigned int	EXIT_CHECK_INTERVAL = 0;
+
+	// Memory kept for the waves whose border is propagated, for the next attempts at a region with the same rules, size and exits. 
+	static constexpr size_t BORDER_CACHE_BYTES = 64 << 20;
+
 public:
+	// Overlapping WFC model, specialized for the pattern size of this configuration. 
+	using WFC_Model = OverlappingWFC<TCHAR, PATTERNS_SIZE>;
+
+	// Chunked WFC model, used for regions larger than CHUNK_SIZE. 
+	using WFC_Chunked_Model = ChunkedWFC<TCHAR, PATTERNS_SIZE>;
+
+	// Tiled WFC model and its tilesets. The tiles must be PATTERNS_SIZE wide, so the border patterns are tiles. 
+	using WFC_Tiled_Model = TilingWFC<TCHAR>;
+	using WFC_Tileset = TilingWFCRules<TCHAR>;
+
 	// Function to convert from side offsets (in units of pattern size) to physical location
 	static inline location_t SIDE_TO_PHYSICAL(EDir side, location_t size, int32 j) {
 		if		(side == E_TOP)		return { 0,							j * PATTERNS_SIZE };
@@ -89,25 +127,110 @@ public:
 		}
 	};
 
+	// Result of a single attempt at generating a region. 
+	struct WFC_Attempt_Output {
+		enum Status { success, constrained, invalid_exit_path, cancelled, aborted } status{ constrained };
+		Array2D<TCHAR> region;		// Contiguous region reachable from the exits, border included. Only set on success. 
+	};
+
+	// Number of attempts by status, over every region generated by this interface. 
+	struct WFC_Generation_Stats {
+		int32 attempts{ 0 };
+		int32 successes{ 0 };
+		int32 constrained{ 0 };			// The WFC ran into a contradiction it couldn't undo. 
+		int32 invalid_exit_paths{ 0 };	// The output didn't connect the exits, found after the run. 
+		int32 aborted{ 0 };				// The exits couldn't be connected anymore, found during the run. 
+		int32 cancelled{ 0 };			// Another attempt of the batch succeeded first. 
+	};
+
+	const WFC_Generation_Stats& GetGenerationStats() const { return generation_stats; }
+
+	// Overlapping WFC options used to generate a region of a certain size (border included). 
+	static OverlappingWFCOptions MakeOptions(location_t size);
+
+	// Tiled WFC options used to generate a region of a certain size (border included, a multiple of PATTERNS_SIZE). 
+	static TilingWFCOptions MakeTiledOptions(location_t size);
+
+	// The patterns PreCollapseBorder sets on the edges, which the pruning of the rules keeps. 
+	static std::vector<Array2D<TCHAR>> GetBorderPatterns();
+
+	// Map the rules of seed from a file written by CompileRules, so they aren't extracted again. 
+	// Returns false if the file is missing or was compiled from another seed, in which case the rules are extracted on first use. 
+	static bool LoadRules(const Array2D<TCHAR>& seed, const FString& path);
+
+	// Extract the rules of seed and write them to a file that LoadRules can map. 
+	static bool CompileRules(const Array2D<TCHAR>& seed, const FString& path);
+
 	// Read a data table representing an image and convert into a 2D array of labels. Optionally prints the data. 
 	Array2D<TCHAR> ReadImage_CSV(UDataTable* Data, bool DebugString = false) const;
 
+	// Read a tileset from a table of FWFCTile_Row and a table of FWFCNeighbour_Row. Returns null if a row is invalid. 
+	std::shared_ptr<const WFC_Tileset> ReadTileset(UDataTable* Tiles, UDataTable* Neighbours) const;
+
+	// Same as ReadTileset, from the CSV files the tables are imported from: a header line, then one row per line with its
+	// name in the first column. Cells can't be quoted. Returns null if a file can't be read or a row is invalid. 
+	std::shared_ptr<const WFC_Tileset> ReadTileset_CSV(const FString& TilesPath, const FString& NeighboursPath) const;
+
 	// Generate a region of a certain size using WFC and a seed determining pattern rules. 
 	Generate_WFC_Region_Output Generate_WFC_Region(const Array2D<TCHAR>& seed, location_t size, std::vector<EDir> exit,
 		RegionLabel region_label = RegionLabel::ship_vents);
 
+	// Generate a region of a certain size using the tiled WFC model. The size, border included, must be a whole number of
+	// tiles, so the border is on the tile grid. Returns the dummy output otherwise. 
+	Generate_WFC_Region_Output Generate_Tiled_Region(std::shared_ptr<const WFC_Tileset> tileset, location_t size, std::vector<EDir> exit,
+		RegionLabel region_label = RegionLabel::ship_vents);
+
+	// Exits at the midpoints of the given sides of a region of a certain size (border included). 
+	static std::vector<ExitLocation> MakeExits(location_t size, const std::vector<EDir>& exits_in);
+
+	// Run WFC once with a border and exits, and check that every exit is reachable. Safe to call from worker threads. 
+	// rules are the rules of seed with options, keeping the border patterns: WFC_Model::get_rules(seed, options, GetBorderPatterns()). 
+	WFC_Attempt_Output Attempt_WFC_Region(const Array2D<TCHAR>& seed, std::shared_ptr<const typename WFC_Model::Rules> rules,
+		const OverlappingWFCOptions& options, const std::vector<ExitLocation>& exits, int32 attempt_seed);
+
+	// Same as Attempt_WFC_Region, with the tiled model. 
+	WFC_Attempt_Output Attempt_Tiled_Region(std::shared_ptr<const WFC_Tileset> tileset, const TilingWFCOptions& options,
+		const std::vector<ExitLocation>& exits, int32 attempt_seed);
+
+	// Turn the output of a run into an attempt result: keep the part reachable from the exits, and check that every exit is reachable. 
+	WFC_Attempt_Output Finish_WFC_Attempt(const std::optional<Array2D<TCHAR>>& out, const WFCStats& stats, location_t size,
+		const std::vector<ExitLocation>& exits, const std::atomic<bool>* cancel);
+
+	// Run attempt(attempt_seed, cancel) in batches of PARALLEL_ATTEMPTS until one succeeds or FAIL_COUNT attempts failed. 
+	template <typename TAttempt>
+	Generate_WFC_Region_Output Run_WFC_Attempts(TAttempt&& attempt, RegionLabel region_label);
+
+	// Crop a successful attempt and compute the properties of its tiles. 
+	Generate_WFC_Region_Output Build_WFC_Region_Output(Array2D<TCHAR> region, RegionLabel region_label);
+
 	// Starting from the seed, remove everything except except the locally contiguous region.
 	// If null=false, select adjacent pixels of the specified color.
 	// If null=true, select adjacent pixels that are NOT the specified color.
 	// Convention: removed parts are replaced by null_space. 
 	Array2D<TCHAR> SelectByColor(const Array2D<TCHAR>& region, location_t seed, TCHAR color, bool null);
 
-	// Precollapse a group of points to a specific pattern before running the WFC. 
-	void PreCollapsePoints(OverlappingWFC<TCHAR>& wfc, const std::vector<location_t>& points, const pattern_t& pattern);
+	// Add to constraints a group of points precollapsed to a specific pattern. Works with every model. 
+	// The pattern id is looked up once, and nothing is propagated until the batch is applied.
+	template <typename TModel>
+	void PreCollapsePoints(TModel& wfc, WFCConstraints& constraints, const std::vector<location_t>& points, const pattern_t& pattern);
 
 	// Generate a border with specified exit points. Useful to contain a generated region and provide an interface to other regions.
 	// Cropping may be necessary after doing this by pattern_size - 1. 
-	void PreCollapseBorder(OverlappingWFC<TCHAR>& wfc, const std::vector<ExitLocation>& exits);
+	// The whole border is applied as one batch of constraints, with a single propagation.
+	template <typename TModel>
+	void PreCollapseBorder(TModel& wfc, const std::vector<ExitLocation>& exits);
+
+	// Same as PreCollapseBorder, but the border of given rules, size and exits is only applied once: the wave is then saved,
+	// and copied into the waves of the next attempts, up to BORDER_CACHE_BYTES. rules must be the rules of wfc, and are
+	// kept alive by the cache. 
+	// Not for the chunked model, whose chunks are only built during the run. 
+	template <typename TModel>
+	void PreCollapseBorderCached(TModel& wfc, std::shared_ptr<const void> rules, const std::vector<ExitLocation>& exits);
+
+	// Keep the exits connected by non blank pixels while the WFC runs, instead of rejecting the output afterwards. 
+	// With EXIT_CHECK_INTERVAL, or with the chunked model whose chunks don't see every exit, the run is aborted instead. 
+	template <typename TModel>
+	void RequireExitPaths(TModel& wfc, const std::vector<ExitLocation>& exits);
 
 	// Utility functions
 
@@ -117,11 +240,57 @@ public:
 
 	static std::vector<size_t> PickUniqueRandomInts(size_t N, size_t max, size_t min = 0);
 
+private:
+	WFC_Generation_Stats generation_stats;
+
+	// Build a tileset from its rows and their names, in table order. Returns null if a row is invalid. 
+	std::shared_ptr<const WFC_Tileset> MakeTileset(const TArray<TPair<FString, FWFCTile_Row>>& TileRows,
+		const TArray<TPair<FString, FWFCNeighbour_Row>>& NeighbourRows) const;
+
+	// What a wave with a propagated border is built from: a snapshot can only be restored in a wave of the same rules,
+	// size and propagation options. 
+	struct BorderKey {
+		std::shared_ptr<const void> rules;
+		location_t size;
+		std::vector<ExitLocation> exits;
+		bool periodic_output;
+		bool prune_patterns;
+		PropagatorEngine engine;
+		bool parallel_propagation;
+
+		bool operator==(const BorderKey&) const = default;
+	};
+
+	// A wave once its border is propagated. The snapshot is set by the attempt that applies the border, bytes being its
+	// size once it is, and 0 before. 
+	struct BorderSnapshot {
+		BorderKey key;
+		std::shared_future<std::shared_ptr<const WFCSnapshot>> snapshot;
+		size_t bytes;
+	};
+
+	// The border snapshots, shared by every interface of this preset, oldest first, and the bytes they hold. 
+	struct BorderCache {
+		std::vector<BorderSnapshot> entries;
+		size_t bytes = 0;
+	};
+
+	static std::mutex& GetBorderCacheMutex() {
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	static BorderCache& GetBorderCache() {
+		static BorderCache cache;
+		return cache;
+	}
+
 }; // namespace WFC_Interface
 
 // Util struct for loading and storing WFC seed tables
 struct SeedPathData {
 	std::string path;
+	std::string rules_file;		// Precompiled rules, relative to the content directory. Must be packaged as a non-asset file. 
 	UDataTable* table;
 	bool loaded;
 
@@ -137,18 +306,68 @@ struct SeedPathData {
 		table->RowStruct = FImageCSV_Row::StaticStruct();
 	}
 
-	explicit SeedPathData(std::string _path) : path(_path), table(nullptr), loaded(false) {}
+	FString rules_path() const {
+		return FPaths::ProjectContentDir() / FString(rules_file.c_str());
+	}
+
+	SeedPathData(std::string _path, std::string _rules_file) : path(_path), rules_file(_rules_file), table(nullptr), loaded(false) {}
 };
 static std::unordered_map<char, SeedPathData> SEED_PATHS = { // List seed datatable paths here
-	{'v', SeedPathData("/Game/Data/Seeds/seed_vent.seed_vent")},
-	{'h', SeedPathData("/Game/Data/Seeds/seed_h.seed_h")}
+	{'v', SeedPathData("/Game/Data/Seeds/seed_vent.seed_vent", "Data/Seeds/seed_vent.wfcrules")},
+	{'h', SeedPathData("/Game/Data/Seeds/seed_h.seed_h", "Data/Seeds/seed_h.wfcrules")}
+};
+
+// Util struct for loading and storing tiled WFC tilesets, a table of tiles and a table of neighbour rules
+struct TilesetPathData {
+	std::string tiles_path;
+	std::string neighbours_path;
+	std::string tiles_csv;			// The CSVs the tables are imported from, relative to the content directory. 
+	std::string neighbours_csv;
+	UDataTable* tiles;
+	UDataTable* neighbours;
+	bool loaded;
+
+	TilesetPathData() : tiles(nullptr), neighbours(nullptr), loaded(false) {}
+
+	// Returns null if the table isn't imported. 
+	static UDataTable* load_table(const std::string& path, UScriptStruct* row_struct) {
+		FSoftObjectPath TablePath = FSoftObjectPath(FString(path.c_str()));
+		UDataTable* table = Cast<UDataTable>(TablePath.ResolveObject());
+		if (!table) table = Cast<UDataTable>(TablePath.TryLoad());
+		if (table) table->RowStruct = row_struct;
+		return table;
+	}
+
+	void load() {
+		if (loaded) return;
+		tiles = load_table(tiles_path, FWFCTile_Row::StaticStruct());
+		neighbours = load_table(neighbours_path, FWFCNeighbour_Row::StaticStruct());
+		loaded = true;
+	}
+
+	// Read the tileset from its tables, or from their CSVs if the tables aren't imported. Returns null if neither can be read. 
+	template<typename Gen> std::shared_ptr<const typename WFC_Interface<Gen>::WFC_Tileset> read(const WFC_Interface<Gen>& generator) {
+		load();
+		if (tiles && neighbours) return generator.ReadTileset(tiles, neighbours);
+		UE_LOG(LogTemp, Warning, TEXT("Tileset tables %s not imported, reading %s."), UTF8_TO_TCHAR(tiles_path.c_str()), UTF8_TO_TCHAR(tiles_csv.c_str()));
+		return generator.ReadTileset_CSV(FPaths::ProjectContentDir() / FString(tiles_csv.c_str()),
+			FPaths::ProjectContentDir() / FString(neighbours_csv.c_str()));
+	}
+
+	TilesetPathData(std::string _tiles_path, std::string _neighbours_path, std::string _tiles_csv, std::string _neighbours_csv)
+		: tiles_path(_tiles_path), neighbours_path(_neighbours_path), tiles_csv(_tiles_csv), neighbours_csv(_neighbours_csv),
+		tiles(nullptr), neighbours(nullptr), loaded(false) {}
+};
+static std::unordered_map<char, TilesetPathData> TILESET_PATHS = { // List tileset datatable paths here
+	{'h', TilesetPathData("/Game/Data/Tilesets/tiles_halls.tiles_halls", "/Game/Data/Tilesets/neighbours_halls.neighbours_halls",
+		"Data/Tilesets/tiles_halls.csv", "Data/Tilesets/neighbours_halls.csv")}
 };
 
 // Struct listing properties associated with each type of region
 struct Region_Properties {
 	float turret_room_density;
 	int32 turret_spacing;
-	char seed_table_id;
+	char seed_table_id;		// Key in SEED_PATHS, or in TILESET_PATHS for tiled specifications. 
 };
 
 template<typename Gen> struct Preset_WFC_Specification {
@@ -161,13 +380,52 @@ template<typename Gen> struct Preset_WFC_Specification {
 	Preset_WFC_Specification(int32 scale_, WFC_Interface<Gen> generator_)
 		: scale{ scale_ }, generator{ generator_ } {
 	}
+
+	// Read the seed and map its precompiled rules. 
+	void Load(char seed_table_id) {
+		auto& path_prop = SEED_PATHS[seed_table_id];
+		path_prop.load();
+		seed = generator.ReadImage_CSV(path_prop.table);
+		check(seed.width > 0);
+		check(seed.height > 0);
+		generator.LoadRules(seed, path_prop.rules_path());
+	}
+
+	typename WFC_Interface<Gen>::Generate_WFC_Region_Output Generate(location_t size, const std::vector<EDir>& exits, RegionLabel region_label) {
+		return generator.Generate_WFC_Region(seed, size, exits, region_label);
+	}
+};
+
+// Same as Preset_WFC_Specification, with the tiled model. 
+template<typename Gen> struct Tiled_WFC_Specification {
+
+	int32 scale{ 1 };
+	WFC_Interface<Gen> generator;
+	std::shared_ptr<const typename WFC_Interface<Gen>::WFC_Tileset> tileset;
+
+	Tiled_WFC_Specification() = default;
+	Tiled_WFC_Specification(int32 scale_, WFC_Interface<Gen> generator_)
+		: scale{ scale_ }, generator{ generator_ } {
+	}
+
+	// Read the tiles and the neighbour rules. 
+	void Load(char tileset_id) {
+		tileset = TILESET_PATHS[tileset_id].read(generator);
+		check(tileset);
+	}
+
+	typename WFC_Interface<Gen>::Generate_WFC_Region_Output Generate(location_t size, const std::vector<EDir>& exits, RegionLabel region_label) {
+		return generator.Generate_Tiled_Region(tileset, size, exits, region_label);
+	}
 };
 
 using SPECIFICATION_VARIANT = std::variant<
-	Preset_WFC_Specification<PRESET_MediumHalls>
+	Preset_WFC_Specification<PRESET_MediumHalls>,
+	Tiled_WFC_Specification<PRESET_MediumHalls>
 >;
 
-// Regions to WFC Gens
+// Regions to WFC Gens. A region moves to the tiled model with Tiled_WFC_Specification and a TILESET_PATHS key,
+// once a tileset is authored for it. 
 struct spec_wrapper {
 	SPECIFICATION_VARIANT spec;
 	Region_Properties properties;
@@ -33,13 +33,29 @@ namespace {
 } // namespace
 
 Wave::Wave(unsigned height, unsigned width,
-    const std::vector<double>& patterns_frequencies) noexcept
+    const std::vector<double>& patterns_frequencies,
+    std::minstd_rand& gen) noexcept
     : patterns_frequencies(patterns_frequencies),
     plogp_patterns_frequencies(get_plogp(patterns_frequencies)),
     min_abs_half_plogp(get_min_abs_half(plogp_patterns_frequencies)),
-    is_impossible(false), nb_patterns(patterns_frequencies.size()),
-    data(width* height, nb_patterns, 1), width(width), height(height),
-    size(height* width) {
+    nb_empty_cells(0), nb_patterns(patterns_frequencies.size()),
+    nb_words(static_cast<unsigned>((nb_patterns + 63) / 64)),
+    data(static_cast<size_t>(width)* height* nb_words), trail_enabled(false),
+    trail_start(0), trail_base(0), width(width), height(height), size(height* width) {
+    // Every pattern is possible in every cell. The bits past nb_patterns in the
+    // last word of a cell stay cleared.
+    std::vector<uint64_t> full_cell(nb_words, ~uint64_t(0));
+    if (nb_patterns % 64 != 0) {
+        full_cell[nb_words - 1] = (uint64_t(1) << (nb_patterns % 64)) - 1;
+    }
+    unsigned nb_patterns_cell = 0;
+    for (uint64_t word : full_cell) {
+        nb_patterns_cell += static_cast<unsigned>(std::popcount(word));
+    }
+    for (unsigned i = 0; i < width * height; i++) {
+        std::copy(full_cell.begin(), full_cell.end(), data.begin() + i * nb_words);
+    }
+
     // Initialize the memoisation of entropy.
     double base_entropy = 0;
     double base_s = 0;
@@ -53,19 +69,117 @@ Wave::Wave(unsigned height, unsigned width,
     memoisation.sum = std::vector<double>(width * height, base_s);
     memoisation.log_sum = std::vector<double>(width * height, log_base_s);
     memoisation.nb_patterns =
-        std::vector<unsigned>(width * height, static_cast<unsigned>(nb_patterns));
+        std::vector<unsigned>(width * height, nb_patterns_cell);
     memoisation.entropy = std::vector<double>(width * height, entropy_base);
+
+    // Draw the noise, and build the heap of undecided cells.
+    std::uniform_real_distribution<> dis(0, min_abs_half_plogp);
+    noise.resize(size);
+    for (unsigned i = 0; i < size; i++) {
+        noise[i] = dis(gen);
+    }
+    heap_position.assign(size, -1);
+    heap_key.resize(size);
+    for (unsigned i = 0; i < size; i++) {
+        heap_key[i] = entropy_base + noise[i];
+    }
+    dirty.assign(size, 0);
+    if (nb_patterns_cell > 1) {
+        heap.resize(size);
+        for (unsigned i = 0; i < size; i++) {
+            heap[i] = i;
+            heap_position[i] = i;
+        }
+        for (unsigned position = size / 2; position-- > 0;) {
+            heap_sift_down(position);
+        }
+    }
 }
 
 
 void Wave::set(unsigned index, unsigned pattern, bool value) noexcept {
-    bool old_value = data.get(index, pattern) != 0;
+    uint64_t& word = data[index * nb_words + (pattern >> 6)];
+    uint64_t mask = uint64_t(1) << (pattern & 63);
+    bool old_value = (word & mask) != 0;
     // If the value isn't changed, nothing needs to be done.
     if (old_value == value) {
         return;
     }
     // Otherwise, the memoisation should be updated.
-    data.get(index, pattern) = value;
+    word ^= mask;
+    if (value) {
+        add_to_memoisation(index, pattern);
+    }
+    else {
+        remove_from_memoisation(index, pattern);
+    }
+}
+
+
+bool Wave::intersect(unsigned index, const uint64_t* mask) noexcept {
+    bool changed = false;
+    unsigned lost_walkable = 0;
+    uint64_t* words = &data[index * nb_words];
+    for (unsigned w = 0; w < nb_words; w++) {
+        uint64_t removed = words[w] & ~mask[w];
+        if (removed == 0) {
+            continue;
+        }
+        changed = true;
+        words[w] &= mask[w];
+        if (!walkable.empty()) {
+            lost_walkable += static_cast<unsigned>(std::popcount(removed & walkable[w]));
+        }
+        while (removed != 0) {
+            unsigned pattern = (w << 6) + static_cast<unsigned>(std::countr_zero(removed));
+            memoisation.plogp_sum[index] -= plogp_patterns_frequencies[pattern];
+            memoisation.sum[index] -= patterns_frequencies[pattern];
+            memoisation.nb_patterns[index]--;
+            if (trail_enabled) {
+                trail.emplace_back(index, pattern);
+            }
+            removed &= removed - 1;
+        }
+    }
+    if (!changed) {
+        return false;
+    }
+
+    // The sums are updated pattern by pattern as in remove_from_memoisation,
+    // but the logarithm and the entropy only once for the cell.
+    memoisation.log_sum[index] = log(memoisation.sum[index]);
+    memoisation.entropy[index] =
+        memoisation.log_sum[index] -
+        memoisation.plogp_sum[index] / memoisation.sum[index];
+    if (memoisation.nb_patterns[index] == 0) {
+        nb_empty_cells++;
+    }
+    if (lost_walkable != 0) {
+        walkable_counts[index] -= lost_walkable;
+        if (walkable_counts[index] == 0) {
+            flip_walkable(index);
+        }
+    }
+    mark_dirty(index);
+    return true;
+}
+
+
+void Wave::add_patterns(unsigned index, const uint64_t* words) noexcept {
+    uint64_t* cell = &data[index * nb_words];
+    for (unsigned w = 0; w < nb_words; w++) {
+        uint64_t added = words[w] & ~cell[w];
+        cell[w] |= added;
+        while (added != 0) {
+            add_to_memoisation(
+                index, (w << 6) + static_cast<unsigned>(std::countr_zero(added)));
+            added &= added - 1;
+        }
+    }
+}
+
+
+void Wave::remove_from_memoisation(unsigned index, unsigned pattern) noexcept {
     memoisation.plogp_sum[index] -= plogp_patterns_frequencies[pattern];
     memoisation.sum[index] -= patterns_frequencies[pattern];
     memoisation.log_sum[index] = log(memoisation.sum[index]);
@@ -76,49 +190,199 @@ void Wave::set(unsigned index, unsigned pattern, bool value) noexcept {
     // If there is no patterns possible in the cell, then there is a
     // contradiction.
     if (memoisation.nb_patterns[index] == 0) {
-        is_impossible = true;
+        nb_empty_cells++;
+    }
+    if (is_walkable(pattern) && --walkable_counts[index] == 0) {
+        flip_walkable(index);
+    }
+    mark_dirty(index);
+    if (trail_enabled) {
+        trail.emplace_back(index, pattern);
     }
 }
 
 
-int Wave::get_min_entropy(std::minstd_rand& gen) const noexcept {
-    if (is_impossible) {
-        return -2;
+void Wave::add_to_memoisation(unsigned index, unsigned pattern) noexcept {
+    if (memoisation.nb_patterns[index] == 0) {
+        nb_empty_cells--;
     }
+    memoisation.plogp_sum[index] += plogp_patterns_frequencies[pattern];
+    memoisation.sum[index] += patterns_frequencies[pattern];
+    memoisation.log_sum[index] = log(memoisation.sum[index]);
+    memoisation.nb_patterns[index]++;
+    memoisation.entropy[index] =
+        memoisation.log_sum[index] -
+        memoisation.plogp_sum[index] / memoisation.sum[index];
+    if (is_walkable(pattern) && walkable_counts[index]++ == 0) {
+        flip_walkable(index);
+    }
+    mark_dirty(index);
+}
 
-    std::uniform_real_distribution<> dis(0, min_abs_half_plogp);
 
-    // The minimum entropy (plus a small noise)
-    double min = std::numeric_limits<double>::infinity();
-    int argmin = -1;
+void Wave::set_walkable(std::vector<uint64_t> mask) noexcept {
+    check(mask.empty() || mask.size() == nb_words);
+    walkable = std::move(mask);
+    walkable_flips.clear();
+    walkable_flipped.assign(walkable.empty() ? 0 : size, 0);
+    count_walkable();
+}
+
 
+void Wave::count_walkable() noexcept {
+    if (walkable.empty()) {
+        walkable_counts.clear();
+        return;
+    }
+    walkable_counts.assign(size, 0);
     for (unsigned i = 0; i < size; i++) {
+        for (unsigned w = 0; w < nb_words; w++) {
+            walkable_counts[i] += static_cast<unsigned>(
+                std::popcount(data[i * nb_words + w] & walkable[w]));
+        }
+    }
+}
 
-        // If the cell is decided, we do not compute the entropy (which is equal
-        // to 0).
-        double nb_patterns_local = memoisation.nb_patterns[i];
-        if (nb_patterns_local == 1) {
-            continue;
+
+void Wave::set_trail_enabled(bool enabled) noexcept {
+    trail_enabled = enabled;
+    if (!enabled) {
+        trail_base += trail.size();
+        trail.clear();
+        trail_start = 0;
+    }
+}
+
+
+void Wave::drop_trail_before(std::size_t position) noexcept {
+    trail_start = std::min(std::max(trail_start, position - std::min(position, trail_base)),
+        trail.size());
+    if (trail_start > trail.size() / 2) {
+        trail.erase(trail.begin(), trail.begin() + trail_start);
+        trail_base += trail_start;
+        trail_start = 0;
+    }
+}
+
+
+void Wave::heap_swap(unsigned a, unsigned b) noexcept {
+    std::swap(heap[a], heap[b]);
+    heap_position[heap[a]] = a;
+    heap_position[heap[b]] = b;
+}
+
+
+void Wave::heap_sift_up(unsigned position) noexcept {
+    while (position > 0) {
+        unsigned parent = (position - 1) / 2;
+        if (heap_key[heap[parent]] <= heap_key[heap[position]]) {
+            return;
         }
+        heap_swap(parent, position);
+        position = parent;
+    }
+}
 
-        // Otherwise, we take the memoised entropy.
-        double entropy = memoisation.entropy[i];
 
-        // We first check if the entropy is less than the minimum.
-        // This is important to reduce noise computation (which is not
-        // negligible).
-        if (entropy <= min) {
+void Wave::heap_sift_down(unsigned position) noexcept {
+    unsigned heap_size = static_cast<unsigned>(heap.size());
+    while (true) {
+        unsigned smallest = position;
+        unsigned left = 2 * position + 1;
+        unsigned right = left + 1;
+        if (left < heap_size && heap_key[heap[left]] < heap_key[heap[smallest]]) {
+            smallest = left;
+        }
+        if (right < heap_size && heap_key[heap[right]] < heap_key[heap[smallest]]) {
+            smallest = right;
+        }
+        if (smallest == position) {
+            return;
+        }
+        heap_swap(position, smallest);
+        position = smallest;
+    }
+}
 
-            // Then, we add noise to decide randomly which will be chosen.
-            // noise is smaller than the smallest p * log(p), so the minimum entropy
-            // will always be chosen.
-            double noise = dis(gen);
-            if (entropy + noise < min) {
-                min = entropy + noise;
-                argmin = i;
-            }
+
+void Wave::heap_update(unsigned index) noexcept {
+    heap_key[index] = memoisation.entropy[index] + noise[index];
+    int position = heap_position[index];
+    bool undecided = memoisation.nb_patterns[index] > 1;
+
+    if (position < 0) {
+        // The cell isn't in the heap, it is inserted if it is undecided.
+        if (undecided) {
+            heap.push_back(index);
+            heap_position[index] = static_cast<int>(heap.size()) - 1;
+            heap_sift_up(static_cast<unsigned>(heap.size()) - 1);
+        }
+        return;
+    }
+
+    if (!undecided) {
+        // The cell is decided, it is replaced by the last element of the heap.
+        unsigned last = static_cast<unsigned>(heap.size()) - 1;
+        heap_swap(position, last);
+        heap.pop_back();
+        heap_position[index] = -1;
+        if (static_cast<unsigned>(position) < heap.size()) {
+            unsigned moved = heap[position];
+            heap_sift_up(position);
+            heap_sift_down(heap_position[moved]);
+        }
+        return;
+    }
+
+    heap_sift_up(position);
+    heap_sift_down(heap_position[index]);
+}
+
+
+void Wave::restore_snapshot(const Snapshot& snapshot) noexcept {
+    check(!trail_enabled && snapshot.data.size() == data.size());
+    data = snapshot.data;
+    memoisation = snapshot.memoisation;
+    nb_empty_cells = snapshot.nb_empty_cells;
+    count_walkable();
+    clear_walkable_flips();
+
+    // The heap is rebuilt from the new entropies, with the noise of this wave.
+    for (unsigned index : dirty_cells) {
+        dirty[index] = 0;
+    }
+    dirty_cells.clear();
+    heap.clear();
+    heap_position.assign(size, -1);
+    for (unsigned i = 0; i < size; i++) {
+        heap_key[i] = memoisation.entropy[i] + noise[i];
+        if (memoisation.nb_patterns[i] > 1) {
+            heap_position[i] = static_cast<int>(heap.size());
+            heap.push_back(i);
         }
     }
+    for (unsigned position = static_cast<unsigned>(heap.size()) / 2; position-- > 0;) {
+        heap_sift_down(position);
+    }
+}
+
 
-    return argmin;
+int Wave::get_min_entropy() noexcept {
+    if (nb_empty_cells != 0) {
+        return -2;
+    }
+
+    // Move the cells whose entropy changed to their new place in the heap.
+    for (unsigned index : dirty_cells) {
+        dirty[index] = 0;
+        heap_update(index);
+    }
+    dirty_cells.clear();
+
+    // The top of the heap is the undecided cell with the minimum entropy (plus
+    // its noise).
+    if (heap.empty()) {
+        return -1;
+    }
+    return static_cast<int>(heap[0]);
 }
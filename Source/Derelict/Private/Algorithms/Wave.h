@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include <bit>
+#include <cstdint>
 #include <random>
 #include <vector>
 
@@ -51,10 +53,10 @@ private:
     EntropyMemoisation memoisation;
 
     /**
-     * This value is set to true if there is a contradiction in the wave (all
-     * elements set to false in a cell).
+     * The number of cells with every element set to false. There is a
+     * contradiction in the wave if it isn't 0.
      */
-    bool is_impossible;
+    unsigned nb_empty_cells;
 
     /**
      * The number of distinct patterns.
@@ -62,10 +64,115 @@ private:
     const size_t nb_patterns;
 
     /**
-     * The actual wave. data.get(index, pattern) is equal to 0 if the pattern can
-     * be placed in the cell index.
+     * The number of 64 bit words used to store the patterns of one cell.
      */
-    Array2D<uint8_t> data;
+    const unsigned nb_words;
+
+    /**
+     * The actual wave, bit-packed with 64 patterns per word. The bit of pattern
+     * in cell index is set if the pattern can be placed in the cell index.
+     * The words of a cell are contiguous.
+     */
+    std::vector<uint64_t> data;
+
+    /**
+     * The noise added to the entropy of every cell, drawn once at construction.
+     * It is smaller than the smallest p * log(p), so it only breaks ties.
+     */
+    std::vector<double> noise;
+
+    /**
+     * Indexed binary min-heap of the undecided cells (more than one pattern),
+     * ordered by heap_key. heap_position[cell] is the position of cell in heap,
+     * or -1 if the cell isn't in the heap. heap_key[cell] is the entropy +
+     * noise of the cell when it was last moved in the heap; the heap only
+     * compares these cached keys, so it stays valid while cells are dirty.
+     */
+    std::vector<unsigned> heap;
+    std::vector<int> heap_position;
+    std::vector<double> heap_key;
+
+    /**
+     * The cells whose entropy changed since the heap was last updated.
+     * dirty[cell] is set while cell is in dirty_cells. The heap is only fixed
+     * up in get_min_entropy, so a cell losing many patterns during one
+     * propagation is only moved once.
+     */
+    std::vector<unsigned> dirty_cells;
+    std::vector<uint8_t> dirty;
+
+    /**
+     * The removals recorded since the trail was enabled, as (index, pattern),
+     * oldest first. The entries before trail_start were dropped and are erased
+     * in bulk once they make up half of the trail. trail_base is the number of
+     * entries erased so far, so trail positions stay valid.
+     */
+    bool trail_enabled;
+    std::vector<std::pair<unsigned, unsigned>> trail;
+    std::size_t trail_start;
+    std::size_t trail_base;
+
+    /**
+     * The patterns counted by walkable_counts, packed as in data, or none.
+     * walkable_counts[cell] is the number of those patterns that can still be
+     * placed in cell. The cells whose count went to or from 0 since the last
+     * clear_walkable_flips are in walkable_flips, walkable_flipped[cell] being
+     * set while cell is in it.
+     */
+    std::vector<uint64_t> walkable;
+    std::vector<unsigned> walkable_counts;
+    std::vector<unsigned> walkable_flips;
+    std::vector<uint8_t> walkable_flipped;
+
+    /**
+     * Return true if pattern is counted by walkable_counts.
+     */
+    bool is_walkable(unsigned pattern) const noexcept {
+        return !walkable.empty() && ((walkable[pattern >> 6] >> (pattern & 63)) & 1);
+    }
+
+    /**
+     * Record that cell index gained or lost its last walkable pattern.
+     */
+    void flip_walkable(unsigned index) noexcept {
+        if (!walkable_flipped[index]) {
+            walkable_flipped[index] = 1;
+            walkable_flips.push_back(index);
+        }
+    }
+
+    /**
+     * Recompute walkable_counts from the patterns of every cell.
+     */
+    void count_walkable() noexcept;
+
+    /**
+     * Update the memoisation after pattern was removed from cell index.
+     */
+    void remove_from_memoisation(unsigned index, unsigned pattern) noexcept;
+
+    /**
+     * Update the memoisation after pattern was added back to cell index.
+     */
+    void add_to_memoisation(unsigned index, unsigned pattern) noexcept;
+
+    /**
+     * Mark cell index as needing to be moved in the heap.
+     */
+    void mark_dirty(unsigned index) noexcept {
+        if (!dirty[index]) {
+            dirty[index] = 1;
+            dirty_cells.push_back(index);
+        }
+    }
+
+    /**
+     * Heap primitives, see heap and heap_position.
+     */
+    void heap_swap(unsigned a, unsigned b) noexcept;
+    void heap_sift_up(unsigned position) noexcept;
+    void heap_sift_down(unsigned position) noexcept;
+    void heap_update(unsigned index) noexcept;
 
 public:
     /**
@@ -75,17 +182,30 @@ public:
     const unsigned height;
     const unsigned size;
 
+    /**
+     * The state of a wave that doesn't depend on the seed: the patterns of
+     * every cell and the memoisation of their entropy. The noise, drawn from
+     * the seed, isn't part of it.
+     */
+    struct Snapshot {
+        std::vector<uint64_t> data;
+        EntropyMemoisation memoisation;
+        unsigned nb_empty_cells;
+    };
+
     /**
      * Initialize the wave with every cell being able to have every pattern.
+     * gen is used to draw the tie-breaking noise of every cell.
      */
     Wave(unsigned height, unsigned width,
-        const std::vector<double>& patterns_frequencies) noexcept;
+        const std::vector<double>& patterns_frequencies,
+        std::minstd_rand& gen) noexcept;
 
     /**
      * Return true if pattern can be placed in cell index.
      */
     bool get(unsigned index, unsigned pattern) const noexcept {
-        return data.get(index, pattern) != 0;
+        return (data[index * nb_words + (pattern >> 6)] >> (pattern & 63)) & 1;
     }
 
     /**
@@ -95,11 +215,175 @@ public:
         return get(i * width + j, pattern);
     }
 
+    /**
+     * Return the number of patterns that can still be placed in cell index.
+     */
+    unsigned get_nb_patterns(unsigned index) const noexcept {
+        return memoisation.nb_patterns[index];
+    }
+
+    /**
+     * Return the entropy of cell index plus its tie-breaking noise, the value
+     * get_min_entropy minimizes.
+     */
+    double get_noisy_entropy(unsigned index) const noexcept {
+        return memoisation.entropy[index] + noise[index];
+    }
+
+    /**
+     * Call f(pattern) for every pattern that can be placed in cell index, in
+     * increasing order. The words are copied before being walked, so f may
+     * remove patterns from the cell.
+     */
+    template <typename F> void for_each_pattern(unsigned index, F&& f) const {
+        const uint64_t* words = &data[index * nb_words];
+        for (unsigned w = 0; w < nb_words; w++) {
+            uint64_t word = words[w];
+            while (word != 0) {
+                f((w << 6) + static_cast<unsigned>(std::countr_zero(word)));
+                word &= word - 1;
+            }
+        }
+    }
+
+    /**
+     * Return the first pattern that can be placed in cell index, or nb_patterns
+     * if there is none.
+     */
+    unsigned get_first_pattern(unsigned index) const noexcept {
+        const uint64_t* words = &data[index * nb_words];
+        for (unsigned w = 0; w < nb_words; w++) {
+            if (words[w] != 0) {
+                return (w << 6) + static_cast<unsigned>(std::countr_zero(words[w]));
+            }
+        }
+        return static_cast<unsigned>(nb_patterns);
+    }
+
+    /**
+     * Return the number of 64 bit words used to store one cell.
+     */
+    unsigned get_nb_words() const noexcept { return nb_words; }
+
+    /**
+     * Return the packed patterns of cell index (get_nb_words() words).
+     */
+    const uint64_t* get_words(unsigned index) const noexcept {
+        return &data[index * nb_words];
+    }
+
+    /**
+     * Remove from cell index every pattern whose bit isn't set in mask.
+     * mask must contain get_nb_words() words.
+     * Return true if at least one pattern was removed.
+     */
+    bool intersect(unsigned index, const uint64_t* mask) noexcept;
+
+    /**
+     * Add back to cell index every pattern whose bit is set in words.
+     * words must contain get_nb_words() words. The additions aren't recorded
+     * in the trail.
+     */
+    void add_patterns(unsigned index, const uint64_t* words) noexcept;
+
     /**
      * Set the value of pattern in cell index.
+     * Removals are recorded in the trail when it is enabled.
      */
     void set(unsigned index, unsigned pattern, bool value) noexcept;
 
+    /**
+     * Remove pattern from cell index without updating the memoisation, the
+     * heap or the trail. Only the words of the cell are written, so different
+     * cells can be changed from several threads at once. Every such removal
+     * must then be passed to commit_removal, from a single thread.
+     */
+    void remove_unsynchronized(unsigned index, unsigned pattern) noexcept {
+        data[index * nb_words + (pattern >> 6)] &= ~(uint64_t(1) << (pattern & 63));
+    }
+
+    /**
+     * Update the memoisation and record in the trail a removal done with
+     * remove_unsynchronized.
+     */
+    void commit_removal(unsigned index, unsigned pattern) noexcept {
+        remove_from_memoisation(index, pattern);
+    }
+
+    /**
+     * Return true if a cell has no possible pattern left.
+     */
+    bool is_contradiction() const noexcept { return nb_empty_cells != 0; }
+
+    /**
+     * Count in every cell, from now on, the patterns whose bit is set in mask.
+     * mask must contain get_nb_words() words, or be empty to stop counting.
+     * This is O(size).
+     */
+    void set_walkable(std::vector<uint64_t> mask) noexcept;
+
+    /**
+     * Return true if cell index can still have a pattern of the set_walkable
+     * mask.
+     */
+    bool can_walk(unsigned index) const noexcept {
+        return walkable_counts[index] != 0;
+    }
+
+    /**
+     * Return the cells that gained or lost their last pattern of the
+     * set_walkable mask since the last clear_walkable_flips, each once. A
+     * cell may have flipped back since.
+     */
+    const std::vector<unsigned>& get_walkable_flips() const noexcept {
+        return walkable_flips;
+    }
+
+    void clear_walkable_flips() noexcept {
+        for (unsigned index : walkable_flips) {
+            walkable_flipped[index] = 0;
+        }
+        walkable_flips.clear();
+    }
+
+    /**
+     * Start or stop recording removals in the trail. Disabling the trail
+     * clears it.
+     */
+    void set_trail_enabled(bool enabled) noexcept;
+
+    /**
+     * Return the position of the end of the trail. Positions are absolute, so
+     * they stay valid after drop_trail_before.
+     */
+    std::size_t get_trail_position() const noexcept {
+        return trail_base + trail.size();
+    }
+
+    /**
+     * Add back every pattern removed after trail position, most recent first,
+     * and call on_restore(index, pattern) for each of them.
+     * position must not be older than the oldest position kept.
+     */
+    template <typename F> void undo_trail(std::size_t position, F&& on_restore) {
+        check(position >= trail_base + trail_start);
+        bool was_enabled = trail_enabled;
+        trail_enabled = false;
+        while (get_trail_position() > position) {
+            auto [index, pattern] = trail.back();
+            trail.pop_back();
+            set(index, pattern, true);
+            on_restore(index, pattern);
+        }
+        trail_enabled = was_enabled;
+    }
+
+    /**
+     * Forget the removals recorded before trail position. They can't be undone
+     * anymore.
+     */
+    void drop_trail_before(std::size_t position) noexcept;
+
     /**
      * Set the value of pattern in cell (i,j).
      */
@@ -111,7 +395,23 @@ public:
      * Return the index of the cell with lowest entropy different of 0.
      * If there is a contradiction in the wave, return -2.
      * If every cell is decided, return -1.
+     * This is O(log n) per cell changed since the last call.
+     */
+    int get_min_entropy() noexcept;
+
+    /**
+     * Return the patterns of every cell and their memoisation.
+     */
+    Snapshot snapshot() const noexcept {
+        return { data, memoisation, nb_empty_cells };
+    }
+
+    /**
+     * Replace the patterns of every cell and their memoisation with the ones
+     * of a snapshot of a wave of the same size and patterns, keeping the noise
+     * of this wave. The trail must be disabled. This is a copy of the words,
+     * and a rebuild of the heap and of the walkable counts in O(size).
      */
-    int get_min_entropy(std::minstd_rand& gen) const noexcept;
+    void restore_snapshot(const Snapshot& snapshot) noexcept;
 
 };
\ No newline at end of file
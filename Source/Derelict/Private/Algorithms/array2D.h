@@ -2,6 +2,8 @@
 
 #include "CoreMinimal.h"
 
+#include <algorithm>
+#include <array>
 #include <vector>
 #include <optional>
 
@@ -238,6 +240,45 @@ public:
     }
 };
 
+/**
+ * Represent a N*N 2D array whose size is known at compile time, stored inline.
+ * It has the same interface as Array2D, so loops bounded by its height and
+ * width are unrolled.
+ */
+template <typename T, std::size_t N> class FixedArray2D {
+
+public:
+    static constexpr std::size_t height = N;
+    static constexpr std::size_t width = N;
+
+    /**
+     * The array containing the data of the 2D array.
+     */
+    std::array<T, N * N> data{};
+
+    FixedArray2D() noexcept {}
+
+    /**
+     * Build a fixed 2D array from a N*N 2D array.
+     */
+    explicit FixedArray2D(const Array2D<T>& a) noexcept {
+        check(a.height == N && a.width == N);
+        std::copy(a.data.begin(), a.data.end(), data.begin());
+    }
+
+    const T& get(std::size_t i, std::size_t j) const noexcept {
+        return data[j + i * N];
+    }
+
+    T& get(std::size_t i, std::size_t j) noexcept {
+        return data[j + i * N];
+    }
+
+    bool operator==(const FixedArray2D<T, N>& a) const noexcept {
+        return data == a.data;
+    }
+};
+
 /**
  * Hash function.
  */
@@ -252,4 +293,15 @@ namespace std {
             return seed;
         }
     };
+
+    template <typename T, std::size_t N> class hash<FixedArray2D<T, N>> {
+    public:
+        std::size_t operator()(const FixedArray2D<T, N>& a) const noexcept {
+            std::size_t seed = a.data.size();
+            for (const T& i : a.data) {
+                seed ^= hash<T>()(i) + (std::size_t)0x9e3779b9 + (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
 } // namespace std
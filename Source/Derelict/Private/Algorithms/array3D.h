@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <functional>
 #include <vector>
 
 #include "CoreMinimal.h"
@@ -76,3 +77,19 @@ public:
         return true;
     }
 };
+
+/**
+ * Hash function.
+ */
+namespace std {
+    template <typename T> class hash<Array3D<T>> {
+    public:
+        std::size_t operator()(const Array3D<T>& a) const noexcept {
+            std::size_t seed = a.data.size();
+            for (const T& i : a.data) {
+                seed ^= hash<T>()(i) + (std::size_t)0x9e3779b9 + (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+} // namespace std
@@ -117,6 +117,32 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Gen Testing")
 	static FWFCOutput TestGrammarToWFC(FMyEventDelegate delegate, int32 RegionSize, int32 GrammarDepth);
 
+	// Extract the rules of every seed in SEED_PATHS and write them next to the seeds, to be mapped at startup. 
+	// Needs to run again whenever a seed changes; stale files are ignored. 
+	UFUNCTION(BlueprintCallable, Category = "Gen Testing")
+	static void CompileSeedRules();
+
+	// Time the AC-4 and bitset propagation engines on the seed_h and seed_vent seeds. 
+	UFUNCTION(BlueprintCallable, Category = "Gen Testing")
+	static void BenchmarkPropagators(int32 RegionSize, int32 Runs);
+
+	// Compare the solve rate, time and contradictions of the observation strategies on the seed_h and seed_vent seeds. 
+	UFUNCTION(BlueprintCallable, Category = "Gen Testing")
+	static void BenchmarkObservations(int32 RegionSize, int32 Runs);
+
+	// Compare the tiled model on the tiles_halls tileset with the overlapping model on the seed_h seed, at the same output size. 
+	// Then generate regions with the tiled model, border and exits included, rounding RegionSize to whole tiles. 
+	UFUNCTION(BlueprintCallable, Category = "Gen Testing")
+	static void BenchmarkTiledModel(int32 RegionSize, int32 Runs);
+
+	// Generate regions with exits on the seed_h and seed_vent seeds, and report how their attempts ended. 
+	UFUNCTION(BlueprintCallable, Category = "Gen Testing")
+	static void BenchmarkRegionAttempts(int32 RegionSize, int32 Runs);
+
+	// Generate volumes of Decks decks with the 3D overlapping model, on a volume of two seed_h decks joined by shafts. 
+	UFUNCTION(BlueprintCallable, Category = "Gen Testing")
+	static void BenchmarkVolumeModel(int32 RegionSize, int32 Decks, int32 Runs);
+
 private:
 	static TArray<float> GenerateRandomFloats(int count);
 	static BP_Dir ConvertDir(const EDir& dir);
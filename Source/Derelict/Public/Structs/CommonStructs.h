@@ -15,6 +15,44 @@ struct FImageCSV_Row : public FTableRowBase
 	FString V;
 };
 
+// A tile of a tiled WFC tileset. The row name is the name of the tile.
+USTRUCT(BlueprintType)
+struct FWFCTile_Row : public FTableRowBase
+{
+	GENERATED_BODY()
+
+	// One of X, T, I, L, \ or P.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	FString Symmetry;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	float Weight = 1.f;
+
+	// The labels of the tile in its first orientation, one row after the other, separated by '/'.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	FString Pixels;
+};
+
+// A neighbour rule of a tiled WFC tileset: Left in LeftOrientation can be placed on the left of Right in RightOrientation.
+// The rotations and reflections of the rule are implied.
+USTRUCT(BlueprintType)
+struct FWFCNeighbour_Row : public FTableRowBase
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	FString Left;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	int32 LeftOrientation = 0;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	FString Right;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite)
+	int32 RightOrientation = 0;
+};
+
 /**
  * 
  */